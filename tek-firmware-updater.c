@@ -1,63 +1,796 @@
 #define COMPILE_AND_EXEC /*
 printf "Compiling %s into %s\n" "${0}" "${0%.*}"
-$CC -ggdb -Wall -pedantic -std=c11 -lusb-1.0 -o "${0%.*}" "${0}"
+$CC -ggdb -Wall -pedantic -std=c11 -pthread -lusb-1.0 -o "${0%.*}" "${0}"
 [ $? -ne 0 ] && exit
 printf "Running %s" "${0%.*}\n"
 valgrind --tool=memcheck --leak-check=full --show-leak-kinds=all "./${0%.*}" $*
 exit
 */
+#define _POSIX_C_SOURCE 200809L
+
 #include <errno.h>
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdbool.h>
 
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
 #include <libusb-1.0/libusb.h>
 
+#include "tekflash.h"
+
 typedef uint8_t  ui8;
 typedef uint16_t ui16;
 
-#define TECK_VENDOR_ID                     0x0E6A
-#define TECK_PRODUCT_ID_NORMAL_STATE       0x030C
-#define TECK_PRODUCT_ID_PROGRAMMABLE_STATE 0x030C
-
 enum tek_device_state_t {
-		TEK_NORMAL_STATE       = TECK_PRODUCT_ID_NORMAL_STATE,
-		TEK_PROGRAMMABLE_STATE = TECK_PRODUCT_ID_PROGRAMMABLE_STATE
+		TEK_NORMAL_STATE,
+		TEK_PROGRAMMABLE_STATE,
+		TEK_DEVICE_STATES_COUNT
+};
+
+// Keyboard revisions the updater knows, supporting a new one is adding its row:
+// X( id, name, vendor id, normal state product id, programmable state product id
+//  , flash size, flash page size, largest transfer )
+// Megawin MG84FL54B doc says 16k of onboard ISP/IAP flash memory, only erased by pages
+// of 512 bytes (ISP/IAP page erase), its bootloader talks full speed control transfers
+// Both states report the same product id on the TEK, so they cannot be told apart yet
+// The state switch is an ISP command of the bootloader, not a property of the profile
+#define TEK_DEVICE_PROFILES( X ) \
+		X( TEK_PROFILE_MG84FL54B, "TEK (Megawin MG84FL54B)", 0x0E6A, 0x030C, 0x030C, 16384, 512, 64 )
+
+enum tek_device_profile_t {
+#define TEK_DEVICE_PROFILE_ID( id, ... ) id,
+		TEK_DEVICE_PROFILES( TEK_DEVICE_PROFILE_ID )
+#undef TEK_DEVICE_PROFILE_ID
+		TEK_DEVICE_PROFILES_COUNT
+};
+
+typedef struct {
+		char const * name;
+		ui16         vendor_id;
+		ui16         product_ids[TEK_DEVICE_STATES_COUNT];
+		size_t       flash_sz;
+		size_t       page_sz;
+		size_t       max_transfer_sz;
+} tek_device_profile;
+
+static tek_device_profile const tek_device_profiles[TEK_DEVICE_PROFILES_COUNT] = {
+#define TEK_DEVICE_PROFILE_ROW( id, name, vendor_id, normal_id, programmable_id, flash_sz, page_sz, transfer_sz ) \
+		[id] = { name, vendor_id, { normal_id, programmable_id }, flash_sz, page_sz, transfer_sz },
+		TEK_DEVICE_PROFILES( TEK_DEVICE_PROFILE_ROW )
+#undef TEK_DEVICE_PROFILE_ROW
+};
+
+// Images are laid out for the largest flash of all profiles, at the page size they
+// all share so that pages and chunks stay compile time constants in the upload loops
+union tek_device_flash_sizes {
+#define TEK_DEVICE_PROFILE_FLASH( id, name, vendor_id, normal_id, programmable_id, flash_sz, ... ) ui8 id[flash_sz];
+		TEK_DEVICE_PROFILES( TEK_DEVICE_PROFILE_FLASH )
+#undef TEK_DEVICE_PROFILE_FLASH
+};
+#define IHEX_BUFFER_MAX_SZ sizeof(union tek_device_flash_sizes)
+#define TEK_FLASH_PAGE_SZ  512
+
+// Firmware image as loaded from an ihex file, bytes not covered by any data
+// record are left in the erased flash state (0xFF) and never sent to the device
+#define IHEX_COVERAGE_WORD_BITS   64
+#define IHEX_COVERAGE_WORDS_COUNT ( IHEX_BUFFER_MAX_SZ / IHEX_COVERAGE_WORD_BITS )
+#define IHEX_PAGES_COUNT          ( IHEX_BUFFER_MAX_SZ / TEK_FLASH_PAGE_SZ )
+// Uploads write each coverage word in one control transfer, setup packet then data
+#define IHEX_WRITE_FRAME_SZ       ( LIBUSB_CONTROL_SETUP_SIZE + IHEX_COVERAGE_WORD_BITS )
+
+#define TEK_DEVICE_PROFILE_GEOMETRY( id, name, vendor_id, normal_id, programmable_id, flash_sz, page_sz, transfer_sz ) \
+		_Static_assert( page_sz == TEK_FLASH_PAGE_SZ && flash_sz % TEK_FLASH_PAGE_SZ == 0 \
+		              , name " pages do not match the image layout" ); \
+		_Static_assert( transfer_sz == IHEX_COVERAGE_WORD_BITS, name " transfers do not match the image write frames" );
+TEK_DEVICE_PROFILES( TEK_DEVICE_PROFILE_GEOMETRY )
+#undef TEK_DEVICE_PROFILE_GEOMETRY
+typedef struct tekflash_image {
+		ui8      bytes[IHEX_BUFFER_MAX_SZ];
+		uint64_t coverage[IHEX_COVERAGE_WORDS_COUNT]; // one bit per byte written
+		uint32_t page_crcs[IHEX_PAGES_COUNT];         // CRC-32 of each flash page
+		uint32_t crc;                                 // CRC-32 of the bytes below highest_addr
+		size_t   highest_addr;
+		// Every transfer an upload can send is laid out here once loaded, transfers point
+		// straight into the image instead of copying chunks into buffers of their own
+		ui8      write_frames[IHEX_COVERAGE_WORDS_COUNT][IHEX_WRITE_FRAME_SZ];
+		ui8      erase_frames[IHEX_PAGES_COUNT][LIBUSB_CONTROL_SETUP_SIZE];
+} ihex_image;
+
+static inline uint64_t image_coverage_word( ihex_image const * image, size_t addr ) {
+		return image->coverage[addr / IHEX_COVERAGE_WORD_BITS];
+}
+
+static bool is_image_page_covered( ihex_image const * image, size_t page_addr ) {
+		for ( size_t addr = page_addr; addr < page_addr + TEK_FLASH_PAGE_SZ; addr += IHEX_COVERAGE_WORD_BITS ) {
+				if ( image_coverage_word( image, addr ) ) {   return true;   }
+		}
+		return false;
+}
+
+// How the ihex file contents are brought into memory before decoding
+enum ihex_load_mode_t {
+		IHEX_LOAD_READ, // single read() into a heap buffer
+		IHEX_LOAD_MMAP  // read-only private mapping of the file
 };
 
-// Megawin MG84FL54B doc says 16k of onboard ISP/IAP flash memory
-// Otherwise, 8bit mode ihex files support addressing up to 65536
-#define IHEX_BUFFER_MAX_SZ 16384
+// With a cache directory, images decoded from the same file contents are reused
+// from a binary cache entry instead of being parsed again
+char const * load_ihex_buffer_from_file( char const * filename
+                                       , enum ihex_load_mode_t load_mode, char const * opt_cache_dir
+                                       , ihex_image * image
+                                       );
+
+// Physical location of a device, stable across the re-enumeration caused by
+// the state switch as long as the keyboard stays plugged in the same port
+// USB 3.0 spec limits hub chains to 7 tiers
+#define USB_MAX_PORT_DEPTH 7
+typedef struct {
+		ui8 bus_number;
+		ui8 port_numbers_sz;
+		ui8 port_numbers[USB_MAX_PORT_DEPTH];
+} usb_port_path;
+
+// "bus-port.port.port...", 3 characters per level at most
+#define USB_PORT_PATH_STRING_SZ (4 + 4*USB_MAX_PORT_DEPTH)
+static char const * format_usb_port_path( usb_port_path const * port_path, char * port_path_string );
+static bool parse_usb_port_path( char const * port_path_string, usb_port_path * port_path );
+
+#define TEK_MAX_DEVICES 127 // USB addresses per bus
+
+_Static_assert( USB_PORT_PATH_STRING_SZ == TEKFLASH_PORT_PATH_SZ, "tekflash.h port path size is out of date" );
+_Static_assert( TEK_MAX_DEVICES == TEKFLASH_MAX_DEVICES, "tekflash.h devices count is out of date" );
 
-char const * load_ihex_buffer_from_file( char const * filename, ui8 * buffer, size_t * buffer_sz );
+char const * find_tek_devices( tekflash_context * context, bool allow_multiple
+                            , usb_port_path * port_paths, size_t * port_paths_sz
+                            );
 
-char const * get_handle_to_tek_device( libusb_device_handle* * usb_device_handle
+// What matching a TEK needs from its device descriptor, as read once when it showed up
+typedef struct {
+		usb_port_path              port_path;
+		libusb_device *            device;
+		tek_device_profile const * profile;
+		ui16                       product_id;
+		ui16                       bcd_device;
+		ui8                        serial_index;
+} tek_attached_device;
+
+// Lookups in the hotplug table, both false without hotplug support
+// A copy of the TEK at port_path with a reference taken on its device, false when not attached
+static bool ref_attached_tek_device( tekflash_context * context, usb_port_path const * port_path
+                                   , tek_attached_device * attached
+                                   );
+// Up to port_paths_sz port paths copied, *attached_count is set to how many TEK there are
+static bool get_attached_tek_port_paths( tekflash_context * context, usb_port_path * port_paths, size_t port_paths_sz
+                                       , size_t * attached_count
+                                       );
+
+// The state is normal whenever the product id allows it
+char const * get_handle_to_tek_device( tekflash_context * context, usb_port_path const * port_path
+                                     , libusb_device_handle* * usb_device_handle
                                      , enum tek_device_state_t * tek_device_state
+                                     , tek_device_profile const * * opt_profile
                                      );
-char const * upload_buffer_to_dev( ui8 * buffer, size_t buffer_sz, libusb_device_handle * usb_device_handle );
+// Serial is left empty for devices without a serial number string, only read when asked for
+char const * get_tek_device_identity( tekflash_context * context, usb_port_path const * port_path, ui16 * bcd_device
+                                    , char * opt_serial, size_t serial_sz
+                                    );
+
+// Called on the usb event thread for every TEK arrival and departure, must not block
+typedef void tek_hotplug_listener( usb_port_path const * port_path, enum tek_device_state_t tek_device_state
+                                 , ui16 bcd_device, bool arrived, void * user_data
+                                 );
+// Keyboards already plugged in when it is set are not reported, the hotplug table has them
+void set_tek_hotplug_listener( tekflash_context * context, tek_hotplug_listener * listener, void * user_data );
+
+// TEK keyboards currently attached, kept up to date from hotplug events delivered
+// on the usb event thread, so that jobs waiting for a re-enumeration just sleep
+// until their port shows up in the expected state
+typedef struct {
+		pthread_mutex_t                mutex;
+		pthread_cond_t                 changed;
+		bool                           enabled;
+		libusb_hotplug_callback_handle callback_handle;
+		tek_hotplug_listener *         listener;
+		void *                         listener_data;
+		size_t                         devices_count;
+		tek_attached_device            devices[TEK_MAX_DEVICES];
+} tek_hotplug_table;
+
+// Default time left to a keyboard to re-enumerate after a state switch
+#define TEK_DEFAULT_RECONNECT_TIMEOUT_MS 5000
+
+// The keyboard seen before the switch keeps its port until it departs, only
+// another device at that port is taken as the re-enumerated one
+char const * wait_for_tek_device( tekflash_context * context, usb_port_path const * port_path
+                                , libusb_device * previous_device
+                                , enum tek_device_state_t tek_device_state, unsigned timeout_ms
+                                , libusb_device_handle* * tek_device_handle
+                                );
+
+// Number of chunks kept in flight while uploading
+#define UPLOAD_DEFAULT_QUEUE_DEPTH 2
+#define UPLOAD_MAX_QUEUE_DEPTH     16
+
+// Transfer latency histogram, log2 buckets in microseconds
+#define UPLOAD_LATENCY_BUCKETS 20
+
+typedef struct {
+		size_t   pages_count;
+		size_t   pages_skipped;
+		size_t   pages_resumed;     // already committed according to the journal
+		size_t   pages_verified;
+		size_t   pages_read_back;
+		size_t   transfers_count;
+		size_t   transfers_failed;
+		size_t   transfers_retried; // sent again while programming a failed page once more
+		size_t   pages_retried;
+		size_t   chunk_resizes;
+		size_t   min_chunk_sz;      // smallest write size the upload went down to
+		size_t   bytes_sent;
+		uint64_t total_latency_ns;
+		uint64_t min_latency_ns;
+		uint64_t max_latency_ns;
+		size_t   latency_histogram[UPLOAD_LATENCY_BUCKETS];
+		size_t   failed_addr;       // where an upload or verify stopped on error
+		int      failed_usb_status; // libusb error of a failed transfer
+} upload_stats;
+
+// Fills the write and erase frames of a freshly decoded image
+void prepare_image_transfers( ihex_image * image );
+
+// Pages confirmed on a device, kept on disk so that a run cut by a power loss or an
+// unplug resumes from the first page left unconfirmed instead of erasing everything
+// One journal per port and serial number, only trusted for the image it was written
+// for; keyboards without a readable serial number are not journaled, another
+// keyboard plugged in the same port could not be told apart
+#define UPLOAD_JOURNAL_PATH_SZ   4096
+#define UPLOAD_JOURNAL_SERIAL_SZ 128
+_Static_assert( IHEX_PAGES_COUNT <= 32, "Journal page masks are 32 bits" );
+
+typedef struct {
+		char     serial[UPLOAD_JOURNAL_SERIAL_SZ];
+		uint32_t image_crc;
+		uint32_t highest_addr;
+		uint32_t committed_pages; // bit per page, erased then fully programmed or already matching
+		uint32_t verified_pages;  // bit per page, checked against the image since committed
+} upload_journal_state;
+
+typedef struct {
+		char                 path[UPLOAD_JOURNAL_PATH_SZ];
+		upload_journal_state state;
+} upload_journal;
+
+// A missing, corrupted or mismatching journal starts over with no page confirmed,
+// false without a serial number to tell the keyboard apart
+bool open_upload_journal( char const * journal_dir, usb_port_path const * port_path, char const * serial
+                        , ihex_image const * image, upload_journal * journal
+                        );
+char const * store_upload_journal( upload_journal const * journal );
+void remove_upload_journal( upload_journal const * journal );
+
+// Stops submitting and fails once opt_cancel is set, after the transfers in flight completed
+// With a journal, pages it holds as committed are left alone and every page is recorded
+// once its transfers are all back
+char const * upload_buffer_to_dev( ihex_image const * image
+                                 , libusb_device_handle * usb_device_handle, bool delta
+                                 , size_t queue_depth, atomic_bool * opt_cancel
+                                 , upload_journal * opt_journal, upload_stats * stats
+                                 );
+// With a journal, pages it holds as verified are not checked again
+char const * verify_image_on_dev( ihex_image const * image
+                                , libusb_device_handle * usb_device_handle
+                                , upload_journal * opt_journal, upload_stats * stats
+                                );
+
+// Uploads behind the same hub share its full speed bandwidth, so they are admitted
+// a few at a time: each hub starts with one slot and gets another while the measured
+// hub throughput keeps improving, up to the --per-hub limit
+#define UPLOAD_DEFAULT_HUB_SLOTS 4
+#define UPLOAD_MAX_HUB_SLOTS     16
+
+// Keyboards plugged straight into a root port are grouped under the root hub
+typedef struct {
+		usb_port_path hub_path;
+		size_t        active;
+		size_t        slots;
+		size_t        peak_active;
+		size_t        uploads_count;
+		size_t        bytes_sent;
+		uint64_t      busy_ns;
+		uint64_t      busy_start_ns;
+		double        level_bytes_per_second[UPLOAD_MAX_HUB_SLOTS + 1]; // hub throughput seen with n uploads
+} upload_hub;
+
+typedef struct {
+		pthread_mutex_t mutex;
+		pthread_cond_t  released;
+		size_t          max_slots;
+		size_t          hubs_count;
+		upload_hub      hubs[TEK_MAX_DEVICES];
+} upload_hub_scheduler;
+
+uint64_t acquire_upload_hub_slot( tekflash_context * context, usb_port_path const * port_path );
+void release_upload_hub_slot( tekflash_context * context, usb_port_path const * port_path
+                            , size_t bytes_sent, uint64_t upload_ns
+                            );
+
+// Everything jobs share is held by their context: libusb, the hotplug table, the hub
+// scheduler and, unless the caller runs its own loop, the thread handling usb events
+// The jobs of the command line and of tekflash_submit run the same way, they only
+// signal the context when over so that an external loop wakes up
+struct tekflash_context {
+		tekflash_options     options;
+		libusb_context *     usb_context;
+		int                  notify_fds[2];
+		pthread_t            usb_event_thread;
+		atomic_bool          usb_event_thread_stop;
+		tek_hotplug_table    hotplug;
+		upload_hub_scheduler hubs;
+};
 
 #define MAX_ERROR_STRING_SZ 256
+
+// Loads an image on its own thread, so that pipelined jobs get their TEK to
+// programmable mode meanwhile and only wait for it before writing anything
+typedef struct {
+		char const *          filename;
+		enum ihex_load_mode_t load_mode;
+		char const *          opt_cache_dir;
+		bool                  dump;
+		ihex_image *          image;
+		pthread_t             thread;
+		pthread_mutex_t       mutex;
+		pthread_cond_t        loaded;
+		bool                  done;
+		uint64_t              load_ns;
+		char const *          error;
+		char                  error_buffer[MAX_ERROR_STRING_SZ];
+} image_loader;
+
+char const * start_image_loader( image_loader * loader, char const * filename
+                               , enum ihex_load_mode_t load_mode, char const * opt_cache_dir
+                               , bool dump, ihex_image * image
+                               );
+char const * wait_for_image_loader( image_loader * loader, uint64_t * opt_load_ns );
+void join_image_loader( image_loader * loader );
+
+// Steps timed by --stats, the first three are shared by every job of a run
+enum flash_phase_t {
+		FLASH_PHASE_LOAD,
+		FLASH_PHASE_USB_INIT,
+		FLASH_PHASE_ENUMERATION,
+		FLASH_PHASE_SWITCH_TO_PROGRAMMABLE,
+		FLASH_PHASE_REENUMERATION,
+		FLASH_PHASE_LOAD_WAIT,
+		FLASH_PHASE_HUB_WAIT,
+		FLASH_PHASE_UPLOAD,
+		FLASH_PHASE_VERIFY,
+		FLASH_PHASE_SWITCH_TO_NORMAL,
+		FLASH_PHASE_NORMAL_REENUMERATION,
+		FLASH_PHASES_COUNT
+};
+
+enum stats_format_t {
+		STATS_NONE,
+		STATS_TABLE,
+		STATS_JSON
+};
+
+// Progress and failures of a job, recorded as fixed size records by the job thread
+// alone and formatted only when reported, the newest TEK_EVENT_LOG_SZ are kept
+#define TEK_EVENT_LOG_SZ 32
+
+enum tek_event_code_t {
+		TEK_EVENT_FOUND,
+		TEK_EVENT_SWITCH_SENT,
+		TEK_EVENT_RECONNECTED,
+		TEK_EVENT_UPLOAD_STARTED,
+		TEK_EVENT_NOT_JOURNALED,
+		TEK_EVENT_RESUMED,         // value pages already committed, extra pages
+		TEK_EVENT_PAGES_SKIPPED,   // value pages skipped, extra pages
+		TEK_EVENT_UPLOAD_DONE,     // value bytes sent, extra transfers
+		TEK_EVENT_PAGES_RETRIED,   // value pages retried, extra failed transfers
+		TEK_EVENT_TRANSFER_FAILED, // value flash address
+		TEK_EVENT_VERIFIED,        // value pages verified, extra pages read back
+		TEK_EVENT_VERIFY_FAILED,   // value page address
+		TEK_EVENT_SWITCHING_BACK,
+		TEK_EVENT_BACK_TO_NORMAL,
+		// Switching back without having written anything
+		TEK_EVENT_ABORTED,         // the firmware file did not load
+		TEK_EVENT_CANCELLED,
+		TEK_EVENT_TOO_LARGE,       // value highest address of the image, extra flash size
+		TEK_EVENT_FAILED           // the text of the error is kept in the job error buffer
+};
+
+typedef struct {
+		uint64_t time_ns;
+		ui8      phase;
+		ui8      code;
+		int      usb_status; // libusb error, 0 for events not about a transfer
+		uint32_t value;
+		uint32_t extra;
+} tek_event;
+
+typedef struct {
+		size_t    events_count; // every event recorded, the ring holds the last TEK_EVENT_LOG_SZ
+		tek_event events[TEK_EVENT_LOG_SZ];
+} tek_event_log;
+
+// One keyboard going through normal -> programmable -> upload -> normal
+// The firmware image is shared read-only between all jobs of a run
+typedef struct tek_flash_job tek_flash_job;
+struct tek_flash_job {
+		tekflash_context * context; // usb, hotplug table and hub scheduler the job runs on
+		usb_port_path port_path;
+		char          log_prefix[USB_PORT_PATH_STRING_SZ + 3];
+		ihex_image const * image;
+		image_loader * opt_loader; // pipelined, image is only valid once the loader is done
+		bool          delta;
+		bool          verify;
+		size_t        queue_depth;
+		unsigned      reconnect_timeout_ms;
+		char const *  opt_journal_dir; // resume interrupted uploads from journals kept there
+		upload_journal journal;
+		atomic_bool * opt_cancel;  // stops the job at its next step once set
+		// Called once the job is done uploading, or failed before; verify, switch back
+		// and the reboot of the keyboard come after and need no scheduler slot
+		void       (* opt_upload_done)( tek_flash_job * job );
+		bool          upload_stage_done;
+		bool          live_events; // print events as they happen rather than in the final report
+		tek_event_log events;
+		upload_stats  upload_stats;
+		uint64_t      phase_ns[FLASH_PHASES_COUNT];
+		pthread_t     thread;
+		bool          thread_started;
+		char const *  error;
+		char          error_buffer[MAX_ERROR_STRING_SZ];
+};
+
+static void * flash_tek_device( void * tek_flash_job );
+
+// Library side of a job, the flashing thread is the one of the inner job
+struct tekflash_job {
+		tek_flash_job job;
+		atomic_bool   cancel;
+		atomic_bool   done;
+		bool          reaped;
+};
+
+// For jobs set up by hand rather than through tekflash_submit
+static char const * start_tekflash_job( tekflash_context * context, tekflash_job * job );
+
+void print_job_events( tek_flash_job const * job );
+void print_flash_stats( tek_flash_job const * job, enum stats_format_t stats_format );
+void print_hub_stats( tekflash_context * context, enum stats_format_t stats_format );
+
+// Keeps libusb and the loaded images warm, flashing keyboards as they get plugged in
+// Returns on a quit command, SIGINT or SIGTERM once running jobs are done
+// With a metrics port other than 0, Prometheus metrics are served on 127.0.0.1 there
+char const * run_tek_daemon( char const * socket_path, char const * opt_firmware_filename
+                           , tekflash_options const * context_options
+                           , tek_flash_job const * job_template, enum stats_format_t stats_format
+                           , size_t metrics_port
+                           );
+
+// Flashes every connected TEK with the image its first matching manifest line maps to,
+// over at most workers_count threads
+#define BATCH_DEFAULT_WORKERS 4
+char const * run_tek_batch( char const * manifest_filename, tekflash_options const * context_options
+                          , tek_flash_job const * job_template, size_t workers_count
+                          , enum stats_format_t stats_format
+                          );
+
+// Parses and validates every file over workers_count threads without opening libusb,
+// results are reported in command line order
+char const * run_ihex_checks( char const * const * filenames, size_t filenames_count
+                            , enum ihex_load_mode_t load_mode, char const * opt_cache_dir
+                            , size_t workers_count
+                            );
+
+// Measures the ihex parser on generated files and the upload pipeline against a
+// simulated bootloader answering each command after latency_us, plus up to jitter_us
+#define BENCH_DEFAULT_LATENCY_US 1000
+#define BENCH_DEFAULT_JITTER_US  250
+char const * run_benchmarks( size_t latency_us, size_t jitter_us );
+
+// Uploads the file to that same simulated bootloader, erased to begin with, and writes
+// every command sent and when it was sent to capture_filename
+char const * run_dry_run_upload( char const * firmware_filename, enum ihex_load_mode_t load_mode, char const * opt_cache_dir
+                               , tek_flash_job const * job_template, size_t latency_us, size_t jitter_us
+                               , char const * capture_filename
+                               );
+// Sends the commands of one or two captures to the simulated bootloader as they were
+// scheduled, then compares their counts, bytes and times side by side
+#define UPLOAD_CAPTURE_MAX_FILES 2
+char const * replay_upload_captures( char const * const * capture_filenames, size_t capture_filenames_count
+                                   , size_t latency_us, size_t jitter_us
+                                   );
+
+// Prints the flash pages and bytes a delta upload of the new image would change on a
+// keyboard holding the old one, and the upload time estimated on the simulated bootloader
+char const * diff_ihex_images( char const * old_filename, char const * new_filename
+                             , enum ihex_load_mode_t load_mode, char const * opt_cache_dir
+                             , size_t queue_depth, size_t latency_us, size_t jitter_us
+                             );
+
+size_t count_image_covered_bytes( ihex_image const * image );
+void print_image_summary( ihex_image const * image );
+char const * dump_image( ihex_image const * image, FILE * output );
+
+// Messages are often formatted around a message returned by an earlier call, so the
+// result is only copied over the previous one once formatting is done
 static char const * format_error( char const * format, ... ) {
-		static /*thread_local*/ char error_buffer[MAX_ERROR_STRING_SZ];
+		static _Thread_local char error_buffer[MAX_ERROR_STRING_SZ];
+		char formatted[MAX_ERROR_STRING_SZ];
 		va_list args;
 		va_start( args, format );
-		vsnprintf( error_buffer, MAX_ERROR_STRING_SZ, format, args );
+		vsnprintf( formatted, MAX_ERROR_STRING_SZ, format, args );
 		va_end( args );
+		memcpy( error_buffer, formatted, MAX_ERROR_STRING_SZ );
 		return error_buffer;
 }
 
+static uint64_t monotonic_time_ns( void ) {
+		struct timespec now;
+		clock_gettime( CLOCK_MONOTONIC, &now );
+		return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// The command line is left out when embedding the updater through tekflash.h
+#ifndef TEKFLASH_NO_MAIN
+static bool parse_size_argument( char const * argument, size_t min, size_t max, size_t * value ) {
+		char * argument_end;
+		errno = 0;
+		unsigned long long parsed = strtoull( argument, &argument_end, 10 );
+		if ( errno || argument_end == argument || *argument_end || parsed < min || parsed > max ) {
+				return false;
+		}
+		*value = (size_t)parsed;
+		return true;
+}
+
 int main( int argc, char *argv[] ) {
 		char const * opt_error = NULL;
 
-		if ( argc != 2 ) {
-				opt_error = format_error( "Usage: %s <firmware file>\n"
-				                          "\tFile must be in Intel 8bit hex format"
-				                        , argv[0]
-				                        );
+		enum ihex_load_mode_t ihex_load_mode = IHEX_LOAD_READ;
+		char const * opt_cache_dir = NULL;
+		char const * opt_journal_dir = NULL;
+		bool flash_all = false;
+		bool delta_upload = false;
+		bool verify_upload = false;
+		size_t upload_queue_depth = UPLOAD_DEFAULT_QUEUE_DEPTH;
+		size_t reconnect_timeout_ms = TEK_DEFAULT_RECONNECT_TIMEOUT_MS;
+		enum stats_format_t stats_format = STATS_NONE;
+		bool dump = false;
+		char const * daemon_socket_path = NULL;
+		size_t metrics_port = 0;
+		char const * batch_manifest_filename = NULL;
+		size_t workers_count = 0; // mode default
+		size_t hub_slots = UPLOAD_DEFAULT_HUB_SLOTS;
+		bool pipelined = false;
+		bool bench = false;
+		size_t bench_latency_us = BENCH_DEFAULT_LATENCY_US;
+		size_t bench_jitter_us = BENCH_DEFAULT_JITTER_US;
+		bool check_only = false;
+		char const * dry_run_capture_filename = NULL;
+		bool replay = false;
+		bool diff = false;
+		// Positional arguments are gathered at the front of argv, after the program name
+		size_t firmware_filenames_count = 0;
+		bool valid_arguments = true;
+		for ( int i = 1; i < argc; ++i ) {
+				if ( strcmp( argv[i], "--mmap" ) == 0 ) {
+						ihex_load_mode = IHEX_LOAD_MMAP;
+				} else if ( strcmp( argv[i], "--cache-dir" ) == 0 && i+1 < argc ) {
+						opt_cache_dir = argv[++i];
+				} else if ( strcmp( argv[i], "--journal-dir" ) == 0 && i+1 < argc ) {
+						opt_journal_dir = argv[++i];
+				} else if ( strcmp( argv[i], "--daemon" ) == 0 && i+1 < argc ) {
+						daemon_socket_path = argv[++i];
+				} else if ( strcmp( argv[i], "--metrics-port" ) == 0 && i+1 < argc ) {
+						if ( !parse_size_argument( argv[++i], 1, UINT16_MAX, &metrics_port ) ) {
+								valid_arguments = false;
+								break;
+						}
+				} else if ( strcmp( argv[i], "--batch" ) == 0 && i+1 < argc ) {
+						batch_manifest_filename = argv[++i];
+				} else if ( strcmp( argv[i], "--jobs" ) == 0 && i+1 < argc ) {
+						if ( !parse_size_argument( argv[++i], 1, TEK_MAX_DEVICES, &workers_count ) ) {
+								valid_arguments = false;
+								break;
+						}
+				} else if ( strcmp( argv[i], "--check-only" ) == 0 ) {
+						check_only = true;
+				} else if ( strcmp( argv[i], "--bench" ) == 0 ) {
+						bench = true;
+				} else if ( strcmp( argv[i], "--dry-run" ) == 0 && i+1 < argc ) {
+						dry_run_capture_filename = argv[++i];
+				} else if ( strcmp( argv[i], "--replay" ) == 0 ) {
+						replay = true;
+				} else if ( strcmp( argv[i], "--diff" ) == 0 ) {
+						diff = true;
+				} else if ( strcmp( argv[i], "--bench-latency" ) == 0 && i+1 < argc ) {
+						if ( !parse_size_argument( argv[++i], 0, 1000000, &bench_latency_us ) ) {
+								valid_arguments = false;
+								break;
+						}
+				} else if ( strcmp( argv[i], "--bench-jitter" ) == 0 && i+1 < argc ) {
+						if ( !parse_size_argument( argv[++i], 0, 1000000, &bench_jitter_us ) ) {
+								valid_arguments = false;
+								break;
+						}
+				} else if ( strcmp( argv[i], "--pipeline" ) == 0 ) {
+						pipelined = true;
+				} else if ( strcmp( argv[i], "--all" ) == 0 ) {
+						flash_all = true;
+				} else if ( strcmp( argv[i], "--delta" ) == 0 ) {
+						delta_upload = true;
+				} else if ( strcmp( argv[i], "--verify" ) == 0 ) {
+						verify_upload = true;
+				} else if ( strcmp( argv[i], "--dump" ) == 0 ) {
+						dump = true;
+				} else if ( strcmp( argv[i], "--stats" ) == 0 ) {
+						stats_format = STATS_TABLE;
+				} else if ( strcmp( argv[i], "--stats=json" ) == 0 ) {
+						stats_format = STATS_JSON;
+				} else if ( strcmp( argv[i], "--queue-depth" ) == 0 && i+1 < argc ) {
+						if ( !parse_size_argument( argv[++i], 1, UPLOAD_MAX_QUEUE_DEPTH, &upload_queue_depth ) ) {
+								valid_arguments = false;
+								break;
+						}
+				} else if ( strcmp( argv[i], "--per-hub" ) == 0 && i+1 < argc ) {
+						if ( !parse_size_argument( argv[++i], 1, UPLOAD_MAX_HUB_SLOTS, &hub_slots ) ) {
+								valid_arguments = false;
+								break;
+						}
+				} else if ( strcmp( argv[i], "--reconnect-timeout" ) == 0 && i+1 < argc ) {
+						if ( !parse_size_argument( argv[++i], 0, UINT32_MAX, &reconnect_timeout_ms ) ) {
+								valid_arguments = false;
+								break;
+						}
+				} else if ( argv[i][0] != '-' ) {
+						argv[1 + firmware_filenames_count++] = argv[i];
+				} else {
+						valid_arguments = false;
+						break;
+				}
+		}
+		char const * firmware_filename = firmware_filenames_count ? argv[1] : NULL;
+		// Checks take any number of files, flashing a single TEK or a dry run exactly one,
+		// daemon mode an optional one, replays one or two captures, diffs two files and other
+		// modes none
+		size_t modes_count = (size_t)bench + (size_t)check_only + !!batch_manifest_filename + !!daemon_socket_path
+		                   + !!dry_run_capture_filename + (size_t)replay + (size_t)diff;
+		bool valid_mode = modes_count == 0         ? firmware_filenames_count == 1
+		                : modes_count != 1         ? false
+		                : check_only               ? firmware_filenames_count >= 1
+		                : daemon_socket_path       ? firmware_filenames_count <= 1
+		                : dry_run_capture_filename ? firmware_filenames_count == 1
+		                : replay                   ? firmware_filenames_count >= 1
+		                                          && firmware_filenames_count <= UPLOAD_CAPTURE_MAX_FILES
+		                : diff                     ? firmware_filenames_count == 2
+		                :                            firmware_filenames_count == 0;
+		// Metrics are only served by the daemon
+		valid_mode = valid_mode && ( !metrics_port || daemon_socket_path );
+		if ( !valid_arguments || !valid_mode ) {
+				// Too long for an error string, printed the same way program_exit would
+				fprintf( stderr, "Error: Usage: %s [options] <firmware file>\n"
+				                 "       %s --daemon <socket> [options] [default firmware file]\n"
+				                 "       %s --batch <manifest> [options]\n"
+				                 "       %s --bench [--bench-latency <us>] [--bench-jitter <us>] [options]\n"
+				                 "       %s --check-only [options] <firmware file>...\n"
+				                 "       %s --dry-run <capture> [options] <firmware file>\n"
+				                 "       %s --replay [options] <capture> [second capture]\n"
+				                 "       %s --diff [options] <old firmware file> <new firmware file>\n"
+				                 "\tFile must be in Intel hex format\n"
+				                 "\t--mmap                   map the firmware file instead of reading it\n"
+				                 "\t--cache-dir <dir>        reuse images decoded by previous runs from <dir>\n"
+				                 "\t--dump                   print a hexdump of the loaded image\n"
+				                 "\t--daemon <socket>        flash TEK as they are plugged in, images are managed\n"
+				                 "\t                         with load/unload/status/quit commands on <socket>\n"
+				                 "\t--metrics-port <port>    serve Prometheus metrics of the daemon on 127.0.0.1:<port>\n"
+				                 "\t--batch <manifest>       flash each TEK with the file of the first manifest line\n"
+				                 "\t                         \"port=<bus-port.port> | serial=<s> | bcd=<hex|any>  <file>\"\n"
+				                 "\t                         that matches it\n"
+				                 "\t--jobs <n>               TEK uploading at once in batch mode (default %d), files\n"
+				                 "\t                         parsed at once with --check-only (default one per core)\n"
+				                 "\t--check-only             only parse and validate the files, usb is left alone\n"
+				                 "\t--bench                  benchmark the parser and a simulated upload, the device\n"
+				                 "\t                         answers after a latency (default %d us) plus jitter (%d us)\n"
+				                 "\t--dry-run <capture>      upload to the simulated device of --bench instead of a TEK,\n"
+				                 "\t                         writing every command and when it was sent to <capture>\n"
+				                 "\t--replay                 send the commands of captures to the simulated device as\n"
+				                 "\t                         they were scheduled, comparing two captures side by side\n"
+				                 "\t--diff                   print the flash pages a delta upload of the new file would\n"
+				                 "\t                         change over the old one, and its time on the simulated device\n"
+				                 "\t--all                    flash every connected TEK in parallel\n"
+				                 "\t--pipeline               load the file while TEK switch to programmable mode,\n"
+				                 "\t                         nothing is written before it is fully validated\n"
+				                 "\t--delta                  only erase and program pages that differ from the device\n"
+				                 "\t--verify                 read back every programmed page and check its crc\n"
+				                 "\t--journal-dir <dir>      record pages confirmed on each TEK in <dir>, reruns after a\n"
+				                 "\t                         power loss or an unplug resume from the first one missing,\n"
+				                 "\t                         only for TEK reporting a serial number\n"
+				                 "\t--queue-depth <n>        usb transfers in flight while uploading (1-%d, default %d)\n"
+				                 "\t--per-hub <n>            most TEK uploading at once behind one hub (1-%d, default %d)\n"
+				                 "\t--reconnect-timeout <ms> time allowed to re-enumerate after a switch (default %d)\n"
+				                 "\t--stats[=json]           time every phase, as a table or one json line per device\n"
+				       , argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], BATCH_DEFAULT_WORKERS
+				       , BENCH_DEFAULT_LATENCY_US, BENCH_DEFAULT_JITTER_US, UPLOAD_MAX_QUEUE_DEPTH, UPLOAD_DEFAULT_QUEUE_DEPTH
+				       , UPLOAD_MAX_HUB_SLOTS, UPLOAD_DEFAULT_HUB_SLOTS
+				       , TEK_DEFAULT_RECONNECT_TIMEOUT_MS
+				       );
+				return EXIT_FAILURE;
+		}
+
+		tekflash_options const context_options = { .opt_cache_dir = opt_cache_dir
+		                                         , .mmap          = ihex_load_mode == IHEX_LOAD_MMAP
+		                                         , .hub_slots     = hub_slots
+		                                         };
+		tek_flash_job const job_template = { .delta       = delta_upload
+		                                   , .verify      = verify_upload
+		                                   , .queue_depth = upload_queue_depth
+		                                   , .reconnect_timeout_ms = (unsigned)reconnect_timeout_ms
+		                                   , .opt_journal_dir = opt_journal_dir
+		                                   };
+
+		if ( daemon_socket_path ) {
+				opt_error = run_tek_daemon( daemon_socket_path, firmware_filename, &context_options
+				                          , &job_template, stats_format, metrics_port
+				                          );
+				goto program_exit;
+		}
+		if ( bench ) {
+				opt_error = run_benchmarks( bench_latency_us, bench_jitter_us );
+				goto program_exit;
+		}
+		if ( dry_run_capture_filename ) {
+				opt_error = run_dry_run_upload( firmware_filename, ihex_load_mode, opt_cache_dir, &job_template
+				                              , bench_latency_us, bench_jitter_us, dry_run_capture_filename
+				                              );
+				goto program_exit;
+		}
+		if ( replay ) {
+				opt_error = replay_upload_captures( (char const * const *)argv + 1, firmware_filenames_count
+				                                  , bench_latency_us, bench_jitter_us
+				                                  );
+				goto program_exit;
+		}
+		if ( diff ) {
+				opt_error = diff_ihex_images( argv[1], argv[2], ihex_load_mode, opt_cache_dir, upload_queue_depth
+				                            , bench_latency_us, bench_jitter_us
+				                            );
+				goto program_exit;
+		}
+		if ( check_only ) {
+				opt_error = run_ihex_checks( (char const * const *)argv + 1, firmware_filenames_count
+				                           , ihex_load_mode, opt_cache_dir, workers_count
+				                           );
+				goto program_exit;
+		}
+		if ( batch_manifest_filename ) {
+				opt_error = run_tek_batch( batch_manifest_filename, &context_options
+				                         , &job_template, workers_count ? workers_count : BATCH_DEFAULT_WORKERS, stats_format
+				                         );
 				goto program_exit;
 		}
 
@@ -65,75 +798,101 @@ int main( int argc, char *argv[] ) {
 
 		// First load the ihex file, if there is a problem
 		// we want to exit early and not change the controller state
-		size_t ihex_buffer_sz = IHEX_BUFFER_MAX_SZ;
-		ui8 ihex_buffer[IHEX_BUFFER_MAX_SZ];
-		char const * call_error = load_ihex_buffer_from_file( argv[1], ihex_buffer, &ihex_buffer_sz );
+		// Pipelined, the keyboards are switched while it loads but nothing is
+		// written to them before it passed every check
+		uint64_t run_phase_ns[FLASH_PHASES_COUNT] = { 0 };
+		static ihex_image image;
+		static image_loader loader;
+		char const * call_error = start_image_loader( &loader, firmware_filename, ihex_load_mode, opt_cache_dir
+		                                            , dump, &image
+		                                            );
 		if ( call_error ) {
-				opt_error = format_error( "Unable to load hex buffer from file: %s", call_error );
+				opt_error = call_error;
 				goto program_exit;
 		}
-
-		for ( size_t i = 0; i < ihex_buffer_sz; ++i ) {
-				printf( "%x", (int)ihex_buffer[i] );
+		if ( !pipelined ) {
+				call_error = wait_for_image_loader( &loader, &run_phase_ns[FLASH_PHASE_LOAD] );
+				if ( call_error ) {
+						opt_error = call_error;
+						goto unwind_image_loader;
+				}
 		}
-		printf( "\n" );
 
 		printf( "Searching for connected TEK\n" );
 
-		int status = libusb_init( NULL );
-		if ( status < 0 ) {
-				opt_error = format_error( "Unable to initialize libusb: %s (%s)"
-				                        , libusb_error_name( status ), libusb_strerror( status )
-				                        );
-				goto program_exit;
+		uint64_t phase_start_ns = monotonic_time_ns();
+		tekflash_context * context;
+		call_error = tekflash_create( &context_options, &context );
+		if ( call_error ) {
+				opt_error = call_error;
+				goto unwind_image_loader;
 		}
+		run_phase_ns[FLASH_PHASE_USB_INIT] = monotonic_time_ns() - phase_start_ns;
+		phase_start_ns = monotonic_time_ns();
 
-		libusb_device_handle * tek_device_handle;
-		enum tek_device_state_t tek_device_state = TEK_NORMAL_STATE ;
-		call_error = get_handle_to_tek_device( &tek_device_handle, &tek_device_state );
+		usb_port_path tek_port_paths[TEK_MAX_DEVICES];
+		size_t tek_port_paths_sz = TEK_MAX_DEVICES;
+		call_error = find_tek_devices( context, flash_all, tek_port_paths, &tek_port_paths_sz );
 		if ( call_error ) {
 				opt_error = format_error( "Unable to connect to a TEK: %s", call_error );
-				goto unwind_usb;
-		}
-		if ( tek_device_state != TEK_NORMAL_STATE ) {
-				opt_error = "Found TEK, but is not in normal mode";
-				goto unwind_tek_device_handle;
+				goto unwind_context;
 		}
+		run_phase_ns[FLASH_PHASE_ENUMERATION] = monotonic_time_ns() - phase_start_ns;
 
-		printf( "TEK found, switching to programmable mode.\n" );
-
-		// TODO Actually switch
-
-		printf( "Command sent, trying to reconnect.\n" );
-
-		libusb_close( tek_device_handle );
-		call_error = get_handle_to_tek_device( &tek_device_handle, &tek_device_state );
-		if ( call_error ) {
-				opt_error = format_error( "Unable to reconnect to the TEK: %s", call_error );
-				goto unwind_usb;
+		if ( flash_all ) {
+				printf( "Found %zu TEK, flashing them in parallel.\n", tek_port_paths_sz );
 		}
-		if ( tek_device_state != TEK_PROGRAMMABLE_STATE ) {
-				opt_error = "Found TEK, but is not in programmable mode";
-				goto unwind_tek_device_handle;
+		static tekflash_job jobs[TEK_MAX_DEVICES];
+		for ( size_t i = 0; i < tek_port_paths_sz; ++i ) {
+				tek_flash_job * job = &jobs[i].job;
+				*job = job_template;
+				job->port_path   = tek_port_paths[i];
+				job->image       = &image;
+				job->opt_loader  = pipelined ? &loader : NULL;
+				job->live_events = !flash_all;
+				memcpy( job->phase_ns, run_phase_ns, sizeof run_phase_ns );
+				if ( flash_all ) {
+						char port_path_string[USB_PORT_PATH_STRING_SZ];
+						snprintf( job->log_prefix, sizeof job->log_prefix, "[%s] "
+						        , format_usb_port_path( &tek_port_paths[i], port_path_string )
+						        );
+				}
+				start_tekflash_job( context, &jobs[i] );
 		}
 
-		printf( "TEK successfully switched to programmable mode.\n" );
-		printf( "Sending new firmware to device.\n" );
-
-		call_error = upload_buffer_to_dev( ihex_buffer, ihex_buffer_sz, tek_device_handle );
-		if ( call_error ) {
-				opt_error = format_error( "Unable to upload buffer to device: %s", call_error );
-				goto unwind_tek_device_handle;
+		if ( !flash_all ) {
+				tekflash_wait( &jobs[0], NULL );
+				print_flash_stats( &jobs[0].job, stats_format );
+				opt_error = jobs[0].job.error;
+				goto unwind_context;
+		}
+		size_t failed_jobs_count = 0;
+		for ( size_t i = 0; i < tek_port_paths_sz; ++i ) {
+				tek_flash_job const * job = &jobs[i].job;
+				tekflash_wait( &jobs[i], NULL );
+				print_job_events( job );
+				if ( job->error ) {
+						fprintf( stderr, "%sError: %s\n", job->log_prefix, job->error );
+						failed_jobs_count += 1;
+				} else {
+						printf( "%sFirmware successfully flashed.\n", job->log_prefix );
+				}
+				print_flash_stats( job, stats_format );
+		}
+		print_hub_stats( context, stats_format );
+		if ( failed_jobs_count ) {
+				opt_error = format_error( "Flashing failed on %zu out of %zu TEK"
+				                        , failed_jobs_count, tek_port_paths_sz
+				                        );
 		}
 
-		printf( "Firmware sent, switching back to normal mode.\n" );
-
-		// TODO Actually switch
-
-	unwind_tek_device_handle:
-		libusb_close( tek_device_handle );
-	unwind_usb:
-		libusb_exit( NULL );
+	unwind_context:
+		tekflash_destroy( context );
+	unwind_image_loader:
+		// A file that did not load is what to fix first, whatever else went wrong
+		call_error = wait_for_image_loader( &loader, NULL );
+		if ( call_error ) {   opt_error = call_error;   }
+		join_image_loader( &loader );
 	program_exit:
 		if ( opt_error ) {
 				fprintf( stderr, "Error: %s\n", opt_error );
@@ -141,83 +900,238 @@ int main( int argc, char *argv[] ) {
 		}
 		return EXIT_SUCCESS;
 }
+#endif
+
+//=== Checksums ===//
+
+// CRC-32 (IEEE 802.3, reflected 0xEDB88320), slice-by-8 tables built on first use
+// Table k gives the CRC of a byte followed by k zero bytes, so 8 input bytes are
+// folded with 8 independent lookups instead of a chain of 8 dependent ones
+static uint32_t       crc32_tables[8][256];
+static pthread_once_t crc32_tables_once = PTHREAD_ONCE_INIT;
+
+static void init_crc32_tables( void ) {
+		for ( uint32_t i = 0; i < 256; ++i ) {
+				uint32_t crc = i;
+				for ( int bit = 0; bit < 8; ++bit ) {
+						crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+				}
+				crc32_tables[0][i] = crc;
+		}
+		for ( size_t k = 1; k < 8; ++k ) {
+				for ( size_t i = 0; i < 256; ++i ) {
+						uint32_t previous = crc32_tables[k-1][i];
+						crc32_tables[k][i] = (previous >> 8) ^ crc32_tables[0][previous & 0xFF];
+				}
+		}
+}
+
+static inline uint32_t load_le32( ui8 const * bytes ) {
+		return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static uint32_t crc32_update( uint32_t crc, void const * data, size_t size ) {
+		pthread_once( &crc32_tables_once, init_crc32_tables );
+		uint32_t (* t)[256] = crc32_tables;
+		ui8 const * bytes = data;
+		crc = ~crc;
+		for ( ; size >= 8; size -= 8, bytes += 8 ) {
+				uint32_t low  = crc ^ load_le32( bytes );
+				uint32_t high = load_le32( bytes + 4 );
+				crc = t[7][low  & 0xFF] ^ t[6][(low  >> 8) & 0xFF] ^ t[5][(low  >> 16) & 0xFF] ^ t[4][low  >> 24]
+				    ^ t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+		}
+		for ( ; size > 0; --size, ++bytes ) {
+				crc = t[0][(crc ^ *bytes) & 0xFF] ^ (crc >> 8);
+		}
+		return ~crc;
+}
+
+// FNV-1a taking 64 bit words at a time, then the bytes left, only names cache entries
+static uint64_t hash_words( void const * data, size_t size ) {
+		ui8 const * bytes = data;
+		uint64_t hash = UINT64_C(0xCBF29CE484222325);
+		for ( ; size >= 8; size -= 8, bytes += 8 ) {
+				uint64_t word;
+				memcpy( &word, bytes, sizeof word );
+				hash = (hash ^ word) * UINT64_C(0x100000001B3);
+		}
+		for ( ; size > 0; --size, ++bytes ) {
+				hash = (hash ^ *bytes) * UINT64_C(0x100000001B3);
+		}
+		return hash;
+}
 
 //=== Intel HEX format loading ===//
 
+// Only the header is staged, data bytes are decoded straight from the line
+// into their destination once the record type and bounds are known
 typedef struct {
-		ui8    size;
-		ui16   addr;
-		ui8    type;
-		ui8    data[256];
-		ui8    checksum;
+		ui8          size;
+		ui16         addr;
+		ui8          type;
+		char const * data_hex;
+		ui8          checksum;
 } ihex_record;
 
-static char const * read_record_from_line( char const * line, ihex_record * record, ui8 * check_sum ) {
+// Hex digit lookup table: valid digits map to their nibble value with bit 4 set,
+// everything else maps to 0; both digits of a byte are checked with a single AND
+#define HEX_NIBBLE_VALID 0x10
+static ui8 const hex_nibble_table[256] = {
+		['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+		['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+		['A'] = 0x1A, ['B'] = 0x1B, ['C'] = 0x1C, ['D'] = 0x1D, ['E'] = 0x1E, ['F'] = 0x1F,
+		['a'] = 0x1A, ['b'] = 0x1B, ['c'] = 0x1C, ['d'] = 0x1D, ['e'] = 0x1E, ['f'] = 0x1F,
+};
+
+static inline bool decode_hex_byte( char const * hex, ui8 * byte ) {
+		ui8 high = hex_nibble_table[(unsigned char)hex[0]];
+		ui8 low  = hex_nibble_table[(unsigned char)hex[1]];
+		*byte = (ui8)((high << 4) | (low & 0x0F));
+		return high & low & HEX_NIBBLE_VALID;
+}
+
+// line is not null-terminated, length excludes the new line character
+static char const * read_record_from_line( char const * line, size_t length, ihex_record * record, ui8 * check_sum ) {
 		assert( line && record && check_sum );
 
-		size_t length = strlen( line );
-		// Do not count carriage return and new line in the ihex line length
-		while ( length > 0 && (line[length-1] == '\n' || line[length-1] == '\r') ) {   length -= 1;   }
+		// Do not count carriage return in the ihex line length
+		while ( length > 0 && line[length-1] == '\r' ) {   length -= 1;   }
 
 		// check that line contains all records and start code BUT data
 		// 11 characters total
 		if ( length < 11 )    {   return "Invalid line length";   }
 		if ( line[0] != ':' ) {   return "Invalid start code";    }
 
-		int size, addr, type;
-		int status = sscanf( line+1, "%2x%4x%2x", &size, &addr, &type );
-		if ( status != 3 ) {   return "Error parsing record header";   }
+		ui8 header[4];
+		for ( size_t i = 0; i < 4; ++i ) {
+				if ( !decode_hex_byte( line+1+2*i, &header[i] ) ) {   return "Error parsing record header";   }
+		}
 		// check that line contains all records and start code AND data
-		if ( length != 11+2*size ) {   return "Invalid line length";   }
-		record->size = (ui8)size;    *check_sum  = (ui8)size;
-		record->addr = (ui16)addr;   *check_sum += (ui8)(addr>>8);
-		                             *check_sum += (ui8)addr;
-		record->type = (ui8)type;    *check_sum += (ui8)type;
+		if ( length != 11+2*(size_t)header[0] ) {   return "Invalid line length";   }
+		record->size = header[0];                          *check_sum  = header[0];
+		record->addr = (ui16)((header[1] << 8) | header[2]); *check_sum += header[1];
+		                                                   *check_sum += header[2];
+		record->type = header[3];                          *check_sum += header[3];
 
-		for ( size_t i = 0; i < size; ++i ) {
-				int datum;
-				status = sscanf( line+9+2*i, "%2x", &datum );
-				if ( status != 1 ) {   return "Error parsing record data";   }
-				record->data[i] = (ui8)datum;   *check_sum += (ui8)datum;
+		record->data_hex = line+9;
+		if ( !decode_hex_byte( line+9+2*(size_t)record->size, &record->checksum ) ) {
+				return "Error parsing record chechsum";
+		}
+
+		return NULL;
+}
+
+static char const * decode_record_data( ihex_record const * record, ui8 * data, ui8 * check_sum ) {
+		assert( record && data && check_sum );
+
+		char const * data_hex = record->data_hex;
+		for ( size_t i = 0; i < record->size; ++i, data_hex += 2 ) {
+				if ( !decode_hex_byte( data_hex, &data[i] ) ) {   return "Error parsing record data";   }
+				*check_sum += data[i];
 		}
-		int checksum;
-		status = sscanf( line+9+2*size, "%2x", &checksum );
-		if ( status != 1 ) {   return "Error parsing record chechsum";   }
-		record->checksum = (ui8)checksum;
 
 		return NULL;
 }
 
-// Data field contains 255 max bytes (since size field is 8bits, 0xFF)
-// Line is 1 ':', 2 hex for size, 4 for addr, 2 for type, 255*2 (max) for data, and 2 for checksum
-// plus two bytes for new line (/r/n) and one for null-termination
-#define IHEX_LINE_MAX_SZ 521
+// Sets the coverage bits of a range a whole word at a time, returns false if any
+// of them was already set by a previous record
+static bool mark_image_covered( ihex_image * image, size_t addr, size_t size ) {
+		uint64_t overlap = 0;
+		size_t end = addr + size;
+		while ( addr < end ) {
+				size_t first = addr % IHEX_COVERAGE_WORD_BITS;
+				size_t count = IHEX_COVERAGE_WORD_BITS - first;
+				if ( count > end - addr ) {   count = end - addr;   }
+				uint64_t mask = count == IHEX_COVERAGE_WORD_BITS ? ~UINT64_C(0) : ((UINT64_C(1) << count) - 1) << first;
+				uint64_t * word = &image->coverage[addr / IHEX_COVERAGE_WORD_BITS];
+				overlap |= *word & mask;
+				*word |= mask;
+				addr += count;
+		}
+		return !overlap;
+}
+
+// Image and page CRCs are folded in while the records are decoded, as long as
+// they come in ascending address order; gaps are folded from the erased buffer
+// Files with records out of order fall back to a pass over the whole image
+typedef struct {
+		size_t   addr;     // everything below has been folded
+		uint32_t image_crc;
+		uint32_t page_crc;
+		bool     in_order;
+} image_crc_state;
+
+static void advance_image_crc( image_crc_state * state, ihex_image * image, size_t end ) {
+		while ( state->addr < end ) {
+				size_t page_end = (state->addr / TEK_FLASH_PAGE_SZ + 1) * TEK_FLASH_PAGE_SZ;
+				size_t chunk_end = end < page_end ? end : page_end;
+				ui8 const * chunk = image->bytes + state->addr;
+				state->image_crc = crc32_update( state->image_crc, chunk, chunk_end - state->addr );
+				state->page_crc  = crc32_update( state->page_crc,  chunk, chunk_end - state->addr );
+				state->addr = chunk_end;
+				if ( chunk_end == page_end ) {
+						image->page_crcs[chunk_end / TEK_FLASH_PAGE_SZ - 1] = state->page_crc;
+						state->page_crc = 0;
+				}
+		}
+}
+
+static void finish_image_crcs( image_crc_state * state, ihex_image * image ) {
+		if ( !state->in_order ) {
+				*state = (image_crc_state){ .in_order = true };
+		}
+		advance_image_crc( state, image, image->highest_addr );
+		image->crc = state->image_crc;
+		advance_image_crc( state, image, IHEX_BUFFER_MAX_SZ );
+}
+
+static char const * load_ihex_buffer( char const * ihex_text, size_t ihex_text_sz, ihex_image * image ) {
+		assert( (ihex_text || !ihex_text_sz) && image );
 
-static char const * load_ihex_buffer( FILE * ihex_file, ui8 * buffer, size_t * buffer_sz ) {
-		assert( ihex_file && buffer && buffer_sz && *buffer_sz );
+		memset( image->bytes, 0xFF, sizeof image->bytes );
+		memset( image->coverage, 0, sizeof image->coverage );
 
+		char const * text_end = ihex_text + ihex_text_sz;
+		char const * line = ihex_text;
 		size_t line_number = 0;
 		size_t highest_addr = 0;
+		// Set by extended segment (02, base is 16 times the segment) and extended
+		// linear (04, upper 16 bits) address records, added to every data record
+		size_t base_addr = 0;
+		image_crc_state crc_state = { .in_order = true };
 		bool last_record_read = false;
 		while ( true ) {
 				line_number += 1;
 
-				char line_buffer[IHEX_LINE_MAX_SZ];
-				if ( !fgets( line_buffer, IHEX_LINE_MAX_SZ, ihex_file ) ) {
-						if ( feof( ihex_file ) ) {
-								if ( last_record_read ) {   break;   } // we're fine! :)
-								return format_error( "Unexpected end-of-file (line %zu)", line_number );
-						}
-						assert( ferror( ihex_file ) );
-						return format_error( "Error reading ihex file (line %zu): %s", line_number, strerror( errno ) );
+				if ( line == text_end ) {
+						if ( last_record_read ) {   break;   } // we're fine! :)
+						return format_error( "Unexpected end-of-file (line %zu)", line_number );
 				}
 				if ( last_record_read ) {
 						return format_error( "Data after last record (line %zu)", line_number );
 				}
 
+				char const * line_end = memchr( line, '\n', (size_t)(text_end - line) );
+				char const * next_line = line_end ? line_end+1 : text_end;
+				if ( !line_end ) {   line_end = text_end;   }
+
 				ihex_record record;
 				ui8 check_sum;
-				char const * error = read_record_from_line( line_buffer, &record, &check_sum );
+				char const * error = read_record_from_line( line, (size_t)(line_end - line), &record, &check_sum );
+				if ( error ) {   return error;   }
+				line = next_line;
+
+				// In-range data records are decoded in place, anything else goes through
+				// a scratch area so that the checksum is validated before acting on it
+				// A single check of the record end covers its whole range: a record
+				// wrapping around its 64K segment starts too high to fit anyway
+				size_t start_addr = base_addr + record.addr;
+				size_t end_addr = start_addr + record.size;
+				bool in_place = record.type == 0 && end_addr <= IHEX_BUFFER_MAX_SZ;
+
+				ui8 scratch[255];
+				error = decode_record_data( &record, in_place ? image->bytes+start_addr : scratch, &check_sum );
 				if ( error ) {   return error;   }
 
 				if ( (ui8)(check_sum + record.checksum) != 0 ) {
@@ -226,114 +1140,4518 @@ static char const * load_ihex_buffer( FILE * ihex_file, ui8 * buffer, size_t * b
 
 				switch ( record.type ) {
 					case 0: {
-							size_t end_addr = record.addr + record.size;
-							if ( end_addr >= *buffer_sz ) {
+							if ( !in_place ) {
 									return format_error( "Addr too high to upload (line %zu)", line_number );
 							}
+							if ( !mark_image_covered( image, start_addr, record.size ) ) {
+									return format_error( "Data record overlaps a previous one (line %zu)", line_number );
+							}
+							if ( start_addr < crc_state.addr ) {
+									crc_state.in_order = false;
+							} else if ( crc_state.in_order ) {
+									advance_image_crc( &crc_state, image, end_addr );
+							}
 							if ( end_addr > highest_addr ) {
 									highest_addr = end_addr;
 							}
-							for ( size_t i = 0; i < record.size; ++i ) {
-									buffer[record.addr+i] = record.data[i];
-							}
 						} break;
 					case 1: {
 							last_record_read = true;
 						} break;
 					case 2:
+					case 4: {
+							if ( record.size != 2 ) {
+									return format_error( "Invalid extended address record (line %zu)", line_number );
+							}
+							size_t value = (size_t)scratch[0] << 8 | scratch[1];
+							base_addr = record.type == 2 ? value << 4 : value << 16;
+						} break;
 					case 3:
-					case 4:
-					case 5:
-						return format_error( "Only support 8bit ihex format (line %zu)", line_number );
+					case 5: {
+							// Start address (CS:IP or EIP), meaningless to the bootloader
+							if ( record.size != 4 ) {
+									return format_error( "Invalid start address record (line %zu)", line_number );
+							}
+						} break;
 					default:
 						return format_error( "Invalid record type (line %zu)", line_number );
 				}
 		}
-		*buffer_sz = highest_addr;
+		image->highest_addr = highest_addr;
+		finish_image_crcs( &crc_state, image );
+		prepare_image_transfers( image );
 		return NULL;
 }
 
-char const * load_ihex_buffer_from_file( char const * filename, ui8 * ihex_buffer, size_t * ihex_buffer_sz ) {
-		char const * opt_error = NULL;
+static char const * read_whole_file( int fd, size_t file_sz, char * * contents ) {
+		*contents = malloc( file_sz ? file_sz : 1 );
+		if ( !*contents ) {   return "Out of memory";   }
 
-		FILE * ihex_file = fopen( filename, "r" );
-		if ( !ihex_file ) {
-				opt_error = format_error( "Unable to open ihex file \"%s\"", filename );
-				goto function_exit;
+		size_t total_read = 0;
+		while ( total_read < file_sz ) {
+				ssize_t read_sz = read( fd, *contents + total_read, file_sz - total_read );
+				if ( read_sz < 0 && errno == EINTR ) {   continue;   }
+				if ( read_sz <= 0 ) {
+						free( *contents );
+						return read_sz < 0 ? strerror( errno ) : "File truncated while reading";
+				}
+				total_read += (size_t)read_sz;
 		}
+		return NULL;
+}
 
-		char const * call_error = load_ihex_buffer( ihex_file, ihex_buffer, ihex_buffer_sz );
-		if ( call_error ) {
-				opt_error = format_error(  "Unable to load hex file: %s", call_error );
-				goto unwind_file;
+// Returns a strerror string, left to the caller to put in context
+static char const * write_whole_file( int fd, void const * data, size_t data_sz ) {
+		size_t written_sz = 0;
+		while ( written_sz < data_sz ) {
+				ssize_t write_sz = write( fd, (ui8 const *)data + written_sz, data_sz - written_sz );
+				if ( write_sz < 0 && errno == EINTR ) {   continue;   }
+				if ( write_sz < 0 ) {   return strerror( errno );   }
+				written_sz += (size_t)write_sz;
 		}
+		return NULL;
+}
 
-	unwind_file:
-		fclose( ihex_file );
-	function_exit:
-		return opt_error;
+//=== Decoded image cache ===//
+
+// Cache entries are named after a hash of the ihex file contents and hold the decoded
+// image in host byte order, its CRC covers the payload, then the ihex text itself
+// Texts sharing a hash are told apart by comparing the stored text on every hit
+#define IMAGE_CACHE_MAGIC   "TEKIMG04"
+#define IMAGE_CACHE_SUFFIX  ".tekimg"
+#define IMAGE_CACHE_PATH_SZ 4096
+
+typedef struct {
+		char     magic[8];
+		uint64_t ihex_sz;
+		uint64_t ihex_hash;
+		uint64_t highest_addr;
+		uint32_t payload_sz;
+		uint32_t payload_crc;
+} image_cache_header;
+
+typedef struct {
+		ui8      bytes[IHEX_BUFFER_MAX_SZ];
+		uint64_t coverage[IHEX_COVERAGE_WORDS_COUNT];
+		uint32_t page_crcs[IHEX_PAGES_COUNT];
+		uint32_t crc;
+} image_cache_payload;
+
+// Followed by the ihex_sz bytes of ihex text
+typedef struct {
+		image_cache_header  header;
+		image_cache_payload payload;
+} image_cache_entry;
+
+typedef struct {
+		char const * ihex_text;
+		size_t       ihex_sz;
+		uint64_t     ihex_hash;
+} image_cache_key;
+
+static void format_image_cache_path( char const * cache_dir, image_cache_key const * key, char * path ) {
+		snprintf( path, IMAGE_CACHE_PATH_SZ, "%s/%016" PRIx64 IMAGE_CACHE_SUFFIX, cache_dir, key->ihex_hash );
 }
 
-//=== USB Device Firmware Update upload ===//
+// A missing, truncated or corrupted entry is a miss, never an error
+static bool load_cached_image( char const * cache_dir, image_cache_key const * key, ihex_image * image ) {
+		char path[IMAGE_CACHE_PATH_SZ];
+		format_image_cache_path( cache_dir, key, path );
 
-char const * get_handle_to_tek_device( libusb_device_handle* * tek_device_handle
-                                     , enum tek_device_state_t * tek_device_state
-                                     ) {
+		int cache_fd = open( path, O_RDONLY );
+		if ( cache_fd < 0 ) {   return false;   }
+		struct stat cache_stat;
+		size_t entry_sz = sizeof(image_cache_entry) + key->ihex_sz;
+		bool hit = fstat( cache_fd, &cache_stat ) == 0 && (size_t)cache_stat.st_size == entry_sz;
+		if ( !hit ) {
+				close( cache_fd );
+				return false;
+		}
+		image_cache_entry const * entry = mmap( NULL, entry_sz, PROT_READ, MAP_PRIVATE, cache_fd, 0 );
+		close( cache_fd );
+		if ( entry == MAP_FAILED ) {   return false;   }
+
+		hit = memcmp( entry->header.magic, IMAGE_CACHE_MAGIC, sizeof entry->header.magic ) == 0
+		   && entry->header.ihex_sz == key->ihex_sz
+		   && entry->header.ihex_hash == key->ihex_hash
+		   && memcmp( entry + 1, key->ihex_text, key->ihex_sz ) == 0
+		   && entry->header.payload_sz == sizeof entry->payload
+		   && entry->header.highest_addr <= IHEX_BUFFER_MAX_SZ
+		   && entry->header.payload_crc == crc32_update( 0, &entry->payload, sizeof entry->payload );
+		if ( hit ) {
+				memcpy( image->bytes, entry->payload.bytes, sizeof image->bytes );
+				memcpy( image->coverage, entry->payload.coverage, sizeof image->coverage );
+				memcpy( image->page_crcs, entry->payload.page_crcs, sizeof image->page_crcs );
+				image->crc = entry->payload.crc;
+				image->highest_addr = (size_t)entry->header.highest_addr;
+				prepare_image_transfers( image );
+		}
+		munmap( (void *)entry, entry_sz );
+		return hit;
+}
+
+// Written to a temporary file then renamed, so that concurrent runs never see a partial entry
+static char const * store_cached_image( char const * cache_dir, image_cache_key const * key, ihex_image const * image ) {
 		char const * opt_error = NULL;
 
-		libusb_device* * usb_devices;
-		int status = libusb_get_device_list( NULL, &usb_devices );
-		if ( status < 0 ) {
-				opt_error = format_error( "Unable to enumerate usb devices: %s (%s)"
-				                        , libusb_strerror( status ), libusb_error_name( status )
-				                        );
+		static _Thread_local image_cache_entry entry;
+		memcpy( entry.header.magic, IMAGE_CACHE_MAGIC, sizeof entry.header.magic );
+		entry.header.ihex_sz      = key->ihex_sz;
+		entry.header.ihex_hash    = key->ihex_hash;
+		entry.header.highest_addr = image->highest_addr;
+		entry.header.payload_sz   = sizeof entry.payload;
+		memcpy( entry.payload.bytes, image->bytes, sizeof entry.payload.bytes );
+		memcpy( entry.payload.coverage, image->coverage, sizeof entry.payload.coverage );
+		memcpy( entry.payload.page_crcs, image->page_crcs, sizeof entry.payload.page_crcs );
+		entry.payload.crc = image->crc;
+		entry.header.payload_crc  = crc32_update( 0, &entry.payload, sizeof entry.payload );
+
+		char path[IMAGE_CACHE_PATH_SZ];
+		format_image_cache_path( cache_dir, key, path );
+		char temporary_path[IMAGE_CACHE_PATH_SZ + 16];
+		snprintf( temporary_path, sizeof temporary_path, "%s.XXXXXX", path );
+
+		// Unique per call, the --check-only workers of one process store concurrently
+		int cache_fd = mkstemp( temporary_path );
+		if ( cache_fd < 0 ) {
+				opt_error = format_error( "Unable to create cache entry \"%s\": %s", temporary_path, strerror( errno ) );
 				goto function_exit;
 		}
+		if ( fchmod( cache_fd, 0644 ) < 0 ) {
+				opt_error = format_error( "Unable to create cache entry \"%s\": %s", temporary_path, strerror( errno ) );
+				goto unwind_temporary_file;
+		}
+		char const * call_error = write_whole_file( cache_fd, &entry, sizeof entry );
+		if ( !call_error ) {   call_error = write_whole_file( cache_fd, key->ihex_text, key->ihex_sz );   }
+		if ( call_error ) {
+				opt_error = format_error( "Unable to write cache entry \"%s\": %s", temporary_path, call_error );
+				goto unwind_temporary_file;
+		}
+		if ( close( cache_fd ) < 0 || rename( temporary_path, path ) < 0 ) {
+				opt_error = format_error( "Unable to store cache entry \"%s\": %s", path, strerror( errno ) );
+				unlink( temporary_path );
+		}
+		goto function_exit;
 
-		libusb_device * tek_device = NULL;
-		for ( libusb_device* * it = usb_devices; *it; ++it ) {
-				struct libusb_device_descriptor usb_device_descriptor;
-				status = libusb_get_device_descriptor( *it, &usb_device_descriptor );
-				if ( status < 0 ) {
-						opt_error = format_error( "Unable to usb get device descriptor: %s (%s)"
-						                        , libusb_strerror( status ), libusb_error_name( status )
+	unwind_temporary_file:
+		close( cache_fd );
+		unlink( temporary_path );
+	function_exit:
+		return opt_error;
+}
+
+char const * load_ihex_buffer_from_file( char const * filename
+                                       , enum ihex_load_mode_t load_mode, char const * opt_cache_dir
+                                       , ihex_image * image
+                                       ) {
+		char const * opt_error = NULL;
+
+		int ihex_fd = open( filename, O_RDONLY );
+		if ( ihex_fd < 0 ) {
+				opt_error = format_error( "Unable to open ihex file \"%s\"", filename );
+				goto function_exit;
+		}
+
+		struct stat ihex_stat;
+		if ( fstat( ihex_fd, &ihex_stat ) < 0 ) {
+				opt_error = format_error( "Unable to stat ihex file \"%s\": %s", filename, strerror( errno ) );
+				goto unwind_file;
+		}
+		size_t ihex_text_sz = (size_t)ihex_stat.st_size;
+
+		char * ihex_text = NULL;
+		char const * call_error = NULL;
+		switch ( load_mode ) {
+			case IHEX_LOAD_READ: {
+					call_error = read_whole_file( ihex_fd, ihex_text_sz, &ihex_text );
+					if ( call_error ) {
+							opt_error = format_error( "Unable to read ihex file \"%s\": %s", filename, call_error );
+							goto unwind_file;
+					}
+				} break;
+			case IHEX_LOAD_MMAP: {
+					// Mapping an empty file fails, let the parser report it
+					if ( ihex_text_sz == 0 ) {   break;   }
+					ihex_text = mmap( NULL, ihex_text_sz, PROT_READ, MAP_PRIVATE, ihex_fd, 0 );
+					if ( ihex_text == MAP_FAILED ) {
+							opt_error = format_error( "Unable to map ihex file \"%s\": %s", filename, strerror( errno ) );
+							goto unwind_file;
+					}
+				} break;
+		}
+
+		image_cache_key cache_key = { .ihex_text = ihex_text, .ihex_sz = ihex_text_sz };
+		if ( opt_cache_dir ) {
+				cache_key.ihex_hash = hash_words( ihex_text, ihex_text_sz );
+				if ( load_cached_image( opt_cache_dir, &cache_key, image ) ) {   goto unwind_file_contents;   }
+		}
+
+		call_error = load_ihex_buffer( ihex_text, ihex_text_sz, image );
+		if ( call_error ) {
+				opt_error = format_error(  "Unable to load hex file: %s", call_error );
+				goto unwind_file_contents;
+		}
+
+		if ( opt_cache_dir ) {
+				call_error = store_cached_image( opt_cache_dir, &cache_key, image );
+				if ( call_error ) {   fprintf( stderr, "Warning: %s\n", call_error );   }
+		}
+
+	unwind_file_contents:
+		if ( load_mode == IHEX_LOAD_MMAP ) {
+				if ( ihex_text ) {   munmap( ihex_text, ihex_text_sz );   }
+		} else {
+				free( ihex_text );
+		}
+	unwind_file:
+		close( ihex_fd );
+	function_exit:
+		return opt_error;
+}
+
+//=== Background image loading ===//
+
+static void * run_image_loader( void * image_loader_ ) {
+		image_loader * loader = image_loader_;
+
+		uint64_t start_ns = monotonic_time_ns();
+		char const * opt_error = load_ihex_buffer_from_file( loader->filename, loader->load_mode, loader->opt_cache_dir
+		                                                   , loader->image
+		                                                   );
+		uint64_t load_ns = monotonic_time_ns() - start_ns;
+		if ( opt_error ) {
+				opt_error = format_error( "Unable to load hex buffer from file: %s", opt_error );
+		} else {
+				print_image_summary( loader->image );
+				if ( loader->dump ) {
+						fflush( stdout );
+						opt_error = dump_image( loader->image, stdout );
+				}
+		}
+
+		pthread_mutex_lock( &loader->mutex );
+		if ( opt_error ) {
+				snprintf( loader->error_buffer, MAX_ERROR_STRING_SZ, "%s", opt_error );
+				loader->error = loader->error_buffer;
+		}
+		loader->load_ns = load_ns;
+		loader->done = true;
+		pthread_cond_broadcast( &loader->loaded );
+		pthread_mutex_unlock( &loader->mutex );
+		return NULL;
+}
+
+char const * start_image_loader( image_loader * loader, char const * filename
+                               , enum ihex_load_mode_t load_mode, char const * opt_cache_dir
+                               , bool dump, ihex_image * image
+                               ) {
+		*loader = (image_loader){ .filename = filename, .load_mode = load_mode, .opt_cache_dir = opt_cache_dir
+		                        , .dump = dump, .image = image
+		                        };
+		pthread_mutex_init( &loader->mutex, NULL );
+		pthread_cond_init( &loader->loaded, NULL );
+		if ( pthread_create( &loader->thread, NULL, run_image_loader, loader ) != 0 ) {
+				pthread_cond_destroy( &loader->loaded );
+				pthread_mutex_destroy( &loader->mutex );
+				return "Unable to start image loading thread";
+		}
+		return NULL;
+}
+
+// Any number of jobs may wait, the image is read-only once the loader is done
+char const * wait_for_image_loader( image_loader * loader, uint64_t * opt_load_ns ) {
+		pthread_mutex_lock( &loader->mutex );
+		while ( !loader->done ) {
+				pthread_cond_wait( &loader->loaded, &loader->mutex );
+		}
+		if ( opt_load_ns ) {   *opt_load_ns = loader->load_ns;   }
+		char const * error = loader->error;
+		pthread_mutex_unlock( &loader->mutex );
+		return error;
+}
+
+void join_image_loader( image_loader * loader ) {
+		pthread_join( loader->thread, NULL );
+		pthread_cond_destroy( &loader->loaded );
+		pthread_mutex_destroy( &loader->mutex );
+}
+
+//=== Image reporting ===//
+
+static bool is_image_byte_covered( ihex_image const * image, size_t addr ) {
+		return image_coverage_word( image, addr ) >> (addr % IHEX_COVERAGE_WORD_BITS) & 1;
+}
+
+size_t count_image_covered_bytes( ihex_image const * image ) {
+		size_t covered_bytes = 0;
+		for ( size_t i = 0; i < IHEX_COVERAGE_WORDS_COUNT; ++i ) {
+				covered_bytes += (size_t)__builtin_popcountll( image->coverage[i] );
+		}
+		return covered_bytes;
+}
+
+void print_image_summary( ihex_image const * image ) {
+		printf( "Image: %zu bytes of data, highest address 0x%04zx, crc32 %08" PRIx32 "\n"
+		      , count_image_covered_bytes( image ), image->highest_addr, image->crc
+		      );
+}
+
+// "aaaa: " + 16 * "xx " + " |" + 16 characters + "|\n"
+#define HEXDUMP_BYTES_PER_LINE 16
+#define HEXDUMP_LINE_SZ        ( 6 + 3*HEXDUMP_BYTES_PER_LINE + 2 + HEXDUMP_BYTES_PER_LINE + 2 )
+
+// Formatted in memory and written with a single fwrite, bytes not covered by a
+// data record are shown as "--" and runs of lines without any data as one "*"
+char const * dump_image( ihex_image const * image, FILE * output ) {
+		static char const hex_digits[] = "0123456789abcdef";
+
+		size_t lines_count = (image->highest_addr + HEXDUMP_BYTES_PER_LINE - 1) / HEXDUMP_BYTES_PER_LINE;
+		char * dump = malloc( lines_count * HEXDUMP_LINE_SZ + 1 );
+		if ( !dump ) {   return "Out of memory";   }
+
+		char * it = dump;
+		bool in_gap = false;
+		for ( size_t line_addr = 0; line_addr < image->highest_addr; line_addr += HEXDUMP_BYTES_PER_LINE ) {
+				uint64_t line_coverage = image_coverage_word( image, line_addr )
+				                       >> (line_addr % IHEX_COVERAGE_WORD_BITS) & ((UINT64_C(1) << HEXDUMP_BYTES_PER_LINE) - 1);
+				if ( !line_coverage ) {
+						if ( !in_gap ) {
+								*it++ = '*';
+								*it++ = '\n';
+						}
+						in_gap = true;
+						continue;
+				}
+				in_gap = false;
+
+				it += sprintf( it, "%04zx: ", line_addr );
+				char * ascii = it + 3*HEXDUMP_BYTES_PER_LINE + 2;
+				for ( size_t addr = line_addr; addr < line_addr + HEXDUMP_BYTES_PER_LINE; ++addr ) {
+						bool shown = addr < image->highest_addr && is_image_byte_covered( image, addr );
+						ui8 byte = image->bytes[addr];
+						*it++ = shown ? hex_digits[byte >> 4]   : '-';
+						*it++ = shown ? hex_digits[byte & 0x0F] : '-';
+						*it++ = ' ';
+						*ascii++ = shown && byte >= 0x20 && byte < 0x7F ? (char)byte : '.';
+				}
+				*it++ = ' ';
+				*it++ = '|';
+				it = ascii;
+				*it++ = '|';
+				*it++ = '\n';
+		}
+
+		size_t dump_sz = (size_t)(it - dump);
+		bool written = fwrite( dump, 1, dump_sz, output ) == dump_sz;
+		free( dump );
+		return written ? NULL : format_error( "Unable to write image dump: %s", strerror( errno ) );
+}
+
+//=== USB Device Firmware Update upload ===//
+
+static char const * format_usb_port_path( usb_port_path const * port_path, char * port_path_string ) {
+		int length = snprintf( port_path_string, USB_PORT_PATH_STRING_SZ, "%d", (int)port_path->bus_number );
+		for ( size_t i = 0; i < port_path->port_numbers_sz; ++i ) {
+				length += snprintf( port_path_string+length, (size_t)(USB_PORT_PATH_STRING_SZ-length)
+				                  , i == 0 ? "-%d" : ".%d", (int)port_path->port_numbers[i]
+				                  );
+		}
+		return port_path_string;
+}
+
+// Inverse of format_usb_port_path
+static bool parse_usb_port_path( char const * port_path_string, usb_port_path * port_path ) {
+		*port_path = (usb_port_path){ 0 };
+		char separator = '-';
+		char const * it = port_path_string;
+		for ( size_t level = 0; level <= USB_MAX_PORT_DEPTH; ++level ) {
+				if ( *it < '0' || *it > '9' ) {   return false;   }
+				char * number_end;
+				errno = 0;
+				unsigned long number = strtoul( it, &number_end, 10 );
+				if ( errno || number > 255 ) {   return false;   }
+				if ( level == 0 ) {
+						port_path->bus_number = (ui8)number;
+				} else {
+						port_path->port_numbers[port_path->port_numbers_sz++] = (ui8)number;
+				}
+				if ( !*number_end )               {   return level > 0;   }
+				if ( *number_end != separator )   {   return false;   }
+				separator = '.';
+				it = number_end + 1;
+		}
+		return false;
+}
+
+static bool usb_port_path_equal( usb_port_path const * lhs, usb_port_path const * rhs ) {
+		return lhs->bus_number == rhs->bus_number
+		    && lhs->port_numbers_sz == rhs->port_numbers_sz
+		    && memcmp( lhs->port_numbers, rhs->port_numbers, lhs->port_numbers_sz ) == 0;
+}
+
+static void get_usb_port_path( libusb_device * usb_device, usb_port_path * port_path ) {
+		port_path->bus_number = libusb_get_bus_number( usb_device );
+		int port_numbers_sz = libusb_get_port_numbers( usb_device, port_path->port_numbers, USB_MAX_PORT_DEPTH );
+		port_path->port_numbers_sz = port_numbers_sz < 0 ? 0 : (ui8)port_numbers_sz;
+}
+
+// NULL for anything that is not a known TEK revision in either state
+static tek_device_profile const * find_tek_device_profile( struct libusb_device_descriptor const * usb_device_descriptor ) {
+		for ( size_t i = 0; i < TEK_DEVICE_PROFILES_COUNT; ++i ) {
+				tek_device_profile const * profile = &tek_device_profiles[i];
+				if ( usb_device_descriptor->idVendor == profile->vendor_id
+				  && (  usb_device_descriptor->idProduct == profile->product_ids[TEK_NORMAL_STATE]
+				     || usb_device_descriptor->idProduct == profile->product_ids[TEK_PROGRAMMABLE_STATE]
+				     )
+				   ) {   return profile;   }
+		}
+		return NULL;
+}
+
+// With the same product id in both states, a TEK may be in either
+static bool is_tek_in_state( tek_attached_device const * attached, enum tek_device_state_t state ) {
+		return attached->profile->product_ids[state] == attached->product_id;
+}
+
+static enum tek_device_state_t get_tek_device_state( tek_attached_device const * attached ) {
+		return is_tek_in_state( attached, TEK_NORMAL_STATE ) ? TEK_NORMAL_STATE : TEK_PROGRAMMABLE_STATE;
+}
+
+static tek_attached_device describe_tek_device( libusb_device * usb_device, usb_port_path const * port_path
+                                              , tek_device_profile const * profile
+                                              , struct libusb_device_descriptor const * usb_device_descriptor
+                                              ) {
+		return (tek_attached_device){ .port_path    = *port_path
+		                            , .device       = libusb_ref_device( usb_device )
+		                            , .profile      = profile
+		                            , .product_id   = usb_device_descriptor->idProduct
+		                            , .bcd_device   = usb_device_descriptor->bcdDevice
+		                            , .serial_index = usb_device_descriptor->iSerialNumber
+		                            };
+}
+
+// Only TEK are described on a scan, and a device whose descriptor cannot be read
+// is skipped so that an unrelated one never fails a whole station
+static char const * scan_tek_devices( tekflash_context * context, usb_port_path const * opt_port_path
+                                    , tek_attached_device * found, size_t found_max, size_t * found_count
+                                    ) {
+		libusb_device* * usb_devices;
+		int status = libusb_get_device_list( context->usb_context, &usb_devices );
+		if ( status < 0 ) {
+				return format_error( "Unable to enumerate usb devices: %s (%s)"
+				                   , libusb_strerror( status ), libusb_error_name( status )
+				                   );
+		}
+
+		*found_count = 0;
+		for ( libusb_device* * it = usb_devices; *it; ++it ) {
+				usb_port_path device_port_path;
+				get_usb_port_path( *it, &device_port_path );
+				if ( opt_port_path && !usb_port_path_equal( &device_port_path, opt_port_path ) ) {   continue;   }
+
+				struct libusb_device_descriptor usb_device_descriptor;
+				if ( libusb_get_device_descriptor( *it, &usb_device_descriptor ) < 0 ) {   continue;   }
+				tek_device_profile const * profile = find_tek_device_profile( &usb_device_descriptor );
+				if ( !profile ) {   continue;   }
+
+				if ( *found_count < found_max ) {
+						found[*found_count] = describe_tek_device( *it, &device_port_path, profile, &usb_device_descriptor );
+				}
+				*found_count += 1;
+		}
+		libusb_free_device_list( usb_devices, true );
+		return NULL;
+}
+
+char const * find_tek_devices( tekflash_context * context, bool allow_multiple
+                            , usb_port_path * port_paths, size_t * port_paths_sz
+                            ) {
+		assert( port_paths && port_paths_sz && *port_paths_sz );
+
+		size_t tek_devices_count;
+		if ( !get_attached_tek_port_paths( context, port_paths, *port_paths_sz, &tek_devices_count ) ) {
+				tek_attached_device found[TEK_MAX_DEVICES];
+				size_t found_max = *port_paths_sz < TEK_MAX_DEVICES ? *port_paths_sz : TEK_MAX_DEVICES;
+				char const * call_error = scan_tek_devices( context, NULL, found, found_max, &tek_devices_count );
+				if ( call_error ) {   return call_error;   }
+				for ( size_t i = 0; i < tek_devices_count && i < found_max; ++i ) {
+						port_paths[i] = found[i].port_path;
+						libusb_unref_device( found[i].device );
+				}
+		}
+
+		if ( tek_devices_count > 1 && !allow_multiple ) {
+				return "Multiple TEK keyboards found; make sure to connect only one";
+		}
+		if ( tek_devices_count > *port_paths_sz ) {   return "Too many TEK keyboards found";   }
+		if ( !tek_devices_count )                 {   return "Unable to find a TEK keyboard device connected";   }
+		*port_paths_sz = tek_devices_count;
+		return NULL;
+}
+
+// Hotplug keeps the descriptors of every attached TEK, the bus is only walked
+// without hotplug support or for a port it does not know about
+// The device of *found is returned with a reference taken
+static char const * find_tek_device( tekflash_context * context, usb_port_path const * port_path
+                                   , tek_attached_device * found
+                                   ) {
+		if ( ref_attached_tek_device( context, port_path, found ) ) {   return NULL;   }
+
+		size_t found_count;
+		char const * call_error = scan_tek_devices( context, port_path, found, 1, &found_count );
+		if ( call_error ) {   return call_error;   }
+		if ( !found_count ) {
+				char port_path_string[USB_PORT_PATH_STRING_SZ];
+				return format_error( "Unable to find a TEK keyboard device connected at %s"
+				                   , format_usb_port_path( port_path, port_path_string )
+				                   );
+		}
+		return NULL;
+}
+
+static char const * open_tek_device( libusb_device * tek_device, libusb_device_handle* * tek_device_handle ) {
+		int status = libusb_open( tek_device, tek_device_handle );
+		if ( status < 0 ) {
+				return format_error( "Unable to get a handle on the TEK device: %s (%s)"
+				                   , libusb_strerror( status ), libusb_error_name( status )
+				                   );
+		}
+		return NULL;
+}
+
+char const * get_handle_to_tek_device( tekflash_context * context, usb_port_path const * port_path
+                                     , libusb_device_handle* * tek_device_handle
+                                     , enum tek_device_state_t * tek_device_state
+                                     , tek_device_profile const * * opt_profile
+                                     ) {
+		tek_attached_device found;
+		char const * call_error = find_tek_device( context, port_path, &found );
+		if ( call_error ) {   return call_error;   }
+
+		char const * opt_error = open_tek_device( found.device, tek_device_handle );
+		*tek_device_state = get_tek_device_state( &found );
+		if ( opt_profile ) {   *opt_profile = found.profile;   }
+		libusb_unref_device( found.device );
+		return opt_error;
+}
+
+// Left empty when serial_index is 0, the device has no serial number string then
+static char const * read_tek_serial_number( libusb_device_handle * tek_device_handle, ui8 serial_index
+                                          , char * serial, size_t serial_sz
+                                          ) {
+		assert( serial_sz > 0 );
+		serial[0] = '\0';
+		if ( !serial_index ) {   return NULL;   }
+
+		int status = libusb_get_string_descriptor_ascii( tek_device_handle, serial_index
+		                                               , (unsigned char *)serial, (int)serial_sz
+		                                               );
+		if ( status < 0 ) {
+				return format_error( "Unable to read the serial number: %s (%s)"
+				                   , libusb_strerror( status ), libusb_error_name( status )
+				                   );
+		}
+		serial[(size_t)status < serial_sz ? (size_t)status : serial_sz - 1] = '\0';
+		return NULL;
+}
+
+// The device is only opened when the serial number is asked for
+char const * get_tek_device_identity( tekflash_context * context, usb_port_path const * port_path, ui16 * bcd_device
+                                    , char * opt_serial, size_t serial_sz
+                                    ) {
+		tek_attached_device found;
+		char const * opt_error = find_tek_device( context, port_path, &found );
+		if ( opt_error ) {   goto function_exit;   }
+		*bcd_device = found.bcd_device;
+
+		if ( opt_serial ) {
+				libusb_device_handle * tek_device_handle;
+				opt_error = open_tek_device( found.device, &tek_device_handle );
+				if ( opt_error ) {   goto unwind_tek_device;   }
+				opt_error = read_tek_serial_number( tek_device_handle, found.serial_index, opt_serial, serial_sz );
+				libusb_close( tek_device_handle );
+		}
+
+	unwind_tek_device:
+		libusb_unref_device( found.device );
+	function_exit:
+		return opt_error;
+}
+
+//=== TEK hotplug tracking ===//
+
+static void notify_tek_hotplug_listener( tek_hotplug_table * hotplug, tek_attached_device const * attached, bool arrived ) {
+		if ( hotplug->listener ) {
+				hotplug->listener( &attached->port_path, get_tek_device_state( attached ), attached->bcd_device
+				                 , arrived, hotplug->listener_data
+				                 );
+		}
+}
+
+static int tek_hotplug_event( libusb_context * usb_context, libusb_device * usb_device
+                            , libusb_hotplug_event event, void * user_data
+                            ) {
+		(void)usb_context;
+		tek_hotplug_table * hotplug = &((tekflash_context *)user_data)->hotplug;
+
+		pthread_mutex_lock( &hotplug->mutex );
+		if ( event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ) {
+				// The vendor is filtered by libusb when profiles share one, products are checked here
+				struct libusb_device_descriptor usb_device_descriptor;
+				tek_device_profile const * profile = NULL;
+				if ( libusb_get_device_descriptor( usb_device, &usb_device_descriptor ) == LIBUSB_SUCCESS ) {
+						profile = find_tek_device_profile( &usb_device_descriptor );
+				}
+				if ( profile && hotplug->devices_count < TEK_MAX_DEVICES ) {
+						usb_port_path port_path;
+						get_usb_port_path( usb_device, &port_path );
+						tek_attached_device * attached = &hotplug->devices[hotplug->devices_count++];
+						*attached = describe_tek_device( usb_device, &port_path, profile, &usb_device_descriptor );
+						notify_tek_hotplug_listener( hotplug, attached, true );
+				}
+		} else {
+				for ( size_t i = 0; i < hotplug->devices_count; ++i ) {
+						if ( hotplug->devices[i].device != usb_device ) {   continue;   }
+						notify_tek_hotplug_listener( hotplug, &hotplug->devices[i], false );
+						libusb_unref_device( hotplug->devices[i].device );
+						hotplug->devices[i] = hotplug->devices[--hotplug->devices_count];
+						break;
+				}
+		}
+		pthread_cond_broadcast( &hotplug->changed );
+		pthread_mutex_unlock( &hotplug->mutex );
+
+		return 0; // keep the callback registered
+}
+
+// Platforms without hotplug support fall back to scanning the bus in wait_for_tek_device
+static char const * start_tek_hotplug( tekflash_context * context ) {
+		tek_hotplug_table * hotplug = &context->hotplug;
+		pthread_mutex_init( &hotplug->mutex, NULL );
+		pthread_condattr_t changed_attr;
+		pthread_condattr_init( &changed_attr );
+		pthread_condattr_setclock( &changed_attr, CLOCK_MONOTONIC );
+		pthread_cond_init( &hotplug->changed, &changed_attr );
+		pthread_condattr_destroy( &changed_attr );
+
+		hotplug->enabled = libusb_has_capability( LIBUSB_CAP_HAS_HOTPLUG );
+		if ( !hotplug->enabled ) {   return NULL;   }
+
+		int vendor_id = tek_device_profiles[0].vendor_id;
+		for ( size_t i = 1; i < TEK_DEVICE_PROFILES_COUNT; ++i ) {
+				if ( tek_device_profiles[i].vendor_id != vendor_id ) {   vendor_id = LIBUSB_HOTPLUG_MATCH_ANY;   }
+		}
+
+		int status = libusb_hotplug_register_callback( context->usb_context
+		                                             , LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT
+		                                             , LIBUSB_HOTPLUG_ENUMERATE
+		                                             , vendor_id, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY
+		                                             , tek_hotplug_event, context, &hotplug->callback_handle
+		                                             );
+		if ( status < 0 ) {
+				hotplug->enabled = false;
+				pthread_cond_destroy( &hotplug->changed );
+				pthread_mutex_destroy( &hotplug->mutex );
+				return format_error( "Unable to register usb hotplug callback: %s (%s)"
+				                   , libusb_strerror( status ), libusb_error_name( status )
+				                   );
+		}
+		return NULL;
+}
+
+void set_tek_hotplug_listener( tekflash_context * context, tek_hotplug_listener * listener, void * user_data ) {
+		tek_hotplug_table * hotplug = &context->hotplug;
+		pthread_mutex_lock( &hotplug->mutex );
+		hotplug->listener      = listener;
+		hotplug->listener_data = user_data;
+		pthread_mutex_unlock( &hotplug->mutex );
+}
+
+static void stop_tek_hotplug( tekflash_context * context ) {
+		tek_hotplug_table * hotplug = &context->hotplug;
+		if ( hotplug->enabled ) {
+				libusb_hotplug_deregister_callback( context->usb_context, hotplug->callback_handle );
+				hotplug->enabled = false;
+		}
+		pthread_mutex_lock( &hotplug->mutex );
+		for ( size_t i = 0; i < hotplug->devices_count; ++i ) {
+				libusb_unref_device( hotplug->devices[i].device );
+		}
+		hotplug->devices_count = 0;
+		pthread_mutex_unlock( &hotplug->mutex );
+		pthread_cond_destroy( &hotplug->changed );
+		pthread_mutex_destroy( &hotplug->mutex );
+}
+
+static bool ref_attached_tek_device( tekflash_context * context, usb_port_path const * port_path
+                                   , tek_attached_device * attached
+                                   ) {
+		tek_hotplug_table * hotplug = &context->hotplug;
+		bool found = false;
+		pthread_mutex_lock( &hotplug->mutex );
+		for ( size_t i = 0; hotplug->enabled && i < hotplug->devices_count; ++i ) {
+				if ( !usb_port_path_equal( &hotplug->devices[i].port_path, port_path ) ) {   continue;   }
+				*attached = hotplug->devices[i];
+				libusb_ref_device( attached->device );
+				found = true;
+				break;
+		}
+		pthread_mutex_unlock( &hotplug->mutex );
+		return found;
+}
+
+static bool get_attached_tek_port_paths( tekflash_context * context, usb_port_path * port_paths, size_t port_paths_sz
+                                       , size_t * attached_count
+                                       ) {
+		tek_hotplug_table * hotplug = &context->hotplug;
+		pthread_mutex_lock( &hotplug->mutex );
+		bool enabled = hotplug->enabled;
+		*attached_count = hotplug->devices_count;
+		for ( size_t i = 0; i < hotplug->devices_count && i < port_paths_sz; ++i ) {
+				port_paths[i] = hotplug->devices[i].port_path;
+		}
+		pthread_mutex_unlock( &hotplug->mutex );
+		return enabled;
+}
+
+#define TEK_POLL_INTERVAL_MS 100
+
+char const * wait_for_tek_device( tekflash_context * context, usb_port_path const * port_path
+                                , libusb_device * previous_device
+                                , enum tek_device_state_t tek_device_state, unsigned timeout_ms
+                                , libusb_device_handle* * tek_device_handle
+                                ) {
+		struct timespec deadline;
+		clock_gettime( CLOCK_MONOTONIC, &deadline );
+		deadline.tv_sec  += timeout_ms / 1000;
+		deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+		if ( deadline.tv_nsec >= 1000000000 ) {   deadline.tv_sec += 1; deadline.tv_nsec -= 1000000000;   }
+
+		tek_hotplug_table * hotplug = &context->hotplug;
+		if ( !hotplug->enabled ) {
+				uint64_t deadline_ns = (uint64_t)deadline.tv_sec * 1000000000u + (uint64_t)deadline.tv_nsec;
+				while ( true ) {
+						tek_attached_device found;
+						if ( !find_tek_device( context, port_path, &found ) ) {
+								bool opened = found.device != previous_device && is_tek_in_state( &found, tek_device_state )
+								           && !open_tek_device( found.device, tek_device_handle );
+								libusb_unref_device( found.device );
+								if ( opened ) {   return NULL;   }
+						}
+						if ( monotonic_time_ns() >= deadline_ns ) {   break;   }
+						nanosleep( &(struct timespec){ .tv_nsec = TEK_POLL_INTERVAL_MS * 1000000 }, NULL );
+				}
+		} else {
+				libusb_device * tek_device = NULL;
+				pthread_mutex_lock( &hotplug->mutex );
+				while ( true ) {
+						for ( size_t i = 0; i < hotplug->devices_count; ++i ) {
+								tek_attached_device const * attached = &hotplug->devices[i];
+								if ( attached->device != previous_device && is_tek_in_state( attached, tek_device_state )
+								  && usb_port_path_equal( &attached->port_path, port_path )
+								   ) {
+										tek_device = libusb_ref_device( attached->device );
+										break;
+								}
+						}
+						if ( tek_device ) {   break;   }
+						if ( pthread_cond_timedwait( &hotplug->changed, &hotplug->mutex, &deadline ) == ETIMEDOUT ) {
+								break;
+						}
+				}
+				pthread_mutex_unlock( &hotplug->mutex );
+
+				if ( tek_device ) {
+						char const * call_error = open_tek_device( tek_device, tek_device_handle );
+						libusb_unref_device( tek_device );
+						return call_error;
+				}
+		}
+
+		char port_path_string[USB_PORT_PATH_STRING_SZ];
+		return format_error( "No TEK in %s state showed up at %s within %u ms"
+		                   , tek_device_state == TEK_NORMAL_STATE ? "normal" : "programmable"
+		                   , format_usb_port_path( port_path, port_path_string ), timeout_ms
+		                   );
+}
+
+//=== USB hub scheduling ===//
+
+static void get_usb_hub_path( usb_port_path const * port_path, usb_port_path * hub_path ) {
+		*hub_path = *port_path;
+		if ( hub_path->port_numbers_sz ) {   hub_path->port_numbers_sz -= 1;   }
+}
+
+// Called with the mutex held
+static upload_hub * find_upload_hub( upload_hub_scheduler * upload_hubs, usb_port_path const * port_path ) {
+		usb_port_path hub_path;
+		get_usb_hub_path( port_path, &hub_path );
+
+		for ( size_t i = 0; i < upload_hubs->hubs_count; ++i ) {
+				if ( usb_port_path_equal( &upload_hubs->hubs[i].hub_path, &hub_path ) ) {   return &upload_hubs->hubs[i];   }
+		}
+		assert( upload_hubs->hubs_count < TEK_MAX_DEVICES );
+		upload_hub * hub = &upload_hubs->hubs[upload_hubs->hubs_count++];
+		*hub = (upload_hub){ .hub_path = hub_path, .slots = 1 };
+		return hub;
+}
+
+// Blocks until the hub of the device has a free slot, returns the time waited
+uint64_t acquire_upload_hub_slot( tekflash_context * context, usb_port_path const * port_path ) {
+		upload_hub_scheduler * upload_hubs = &context->hubs;
+		uint64_t wait_start_ns = monotonic_time_ns();
+		pthread_mutex_lock( &upload_hubs->mutex );
+		upload_hub * hub = find_upload_hub( upload_hubs, port_path );
+		while ( hub->active >= hub->slots ) {
+				pthread_cond_wait( &upload_hubs->released, &upload_hubs->mutex );
+		}
+		uint64_t now_ns = monotonic_time_ns();
+		if ( hub->active++ == 0 ) {   hub->busy_start_ns = now_ns;   }
+		if ( hub->active > hub->peak_active ) {   hub->peak_active = hub->active;   }
+		pthread_mutex_unlock( &upload_hubs->mutex );
+		return now_ns - wait_start_ns;
+}
+
+// The upload rate times the uploads running alongside it estimates the hub throughput
+// at that level; a slot is added while a level beats the one below by 10%, and
+// taken back when it does worse
+void release_upload_hub_slot( tekflash_context * context, usb_port_path const * port_path
+                            , size_t bytes_sent, uint64_t upload_ns
+                            ) {
+		upload_hub_scheduler * upload_hubs = &context->hubs;
+		pthread_mutex_lock( &upload_hubs->mutex );
+		upload_hub * hub = find_upload_hub( upload_hubs, port_path );
+		assert( hub->active > 0 );
+
+		size_t level = hub->active;
+		if ( bytes_sent && upload_ns ) {
+				double * level_rate = hub->level_bytes_per_second;
+				double rate = bytes_sent * 1e9 / upload_ns * level;
+				level_rate[level] = level_rate[level] ? (3 * level_rate[level] + rate) / 4 : rate;
+				if ( level == hub->slots ) {
+						if ( hub->slots < upload_hubs->max_slots && (level == 1 || level_rate[level] > 1.1 * level_rate[level-1]) ) {
+								hub->slots += 1;
+						} else if ( level > 1 && level_rate[level] < level_rate[level-1] ) {
+								hub->slots -= 1;
+						}
+				}
+		}
+		if ( hub->slots > upload_hubs->max_slots ) {   hub->slots = upload_hubs->max_slots;   }
+
+		hub->uploads_count += 1;
+		hub->bytes_sent    += bytes_sent;
+		if ( --hub->active == 0 ) {   hub->busy_ns += monotonic_time_ns() - hub->busy_start_ns;   }
+		pthread_cond_broadcast( &upload_hubs->released );
+		pthread_mutex_unlock( &upload_hubs->mutex );
+}
+
+//=== Statistics ===//
+
+static char const * const flash_phase_names[FLASH_PHASES_COUNT] = {
+		[FLASH_PHASE_LOAD]                   = "load",
+		[FLASH_PHASE_USB_INIT]               = "usb_init",
+		[FLASH_PHASE_ENUMERATION]            = "enumeration",
+		[FLASH_PHASE_SWITCH_TO_PROGRAMMABLE] = "switch_to_programmable",
+		[FLASH_PHASE_REENUMERATION]          = "reenumeration",
+		[FLASH_PHASE_LOAD_WAIT]              = "load_wait",
+		[FLASH_PHASE_HUB_WAIT]               = "hub_wait",
+		[FLASH_PHASE_UPLOAD]                 = "upload",
+		[FLASH_PHASE_VERIFY]                 = "verify",
+		[FLASH_PHASE_SWITCH_TO_NORMAL]       = "switch_to_normal",
+		[FLASH_PHASE_NORMAL_REENUMERATION]   = "normal_reenumeration",
+};
+
+// Bucket b counts latencies in [2^b, 2^(b+1)) microseconds, the last one everything above
+static size_t upload_latency_bucket( uint64_t latency_ns ) {
+		uint64_t latency_us = latency_ns / 1000;
+		size_t bucket = 63 - (size_t)__builtin_clzll( latency_us | 1 );
+		return bucket < UPLOAD_LATENCY_BUCKETS ? bucket : UPLOAD_LATENCY_BUCKETS - 1;
+}
+
+static double upload_bytes_per_second( tek_flash_job const * job ) {
+		uint64_t upload_ns = job->phase_ns[FLASH_PHASE_UPLOAD];
+		return upload_ns ? job->upload_stats.bytes_sent * 1e9 / upload_ns : 0.0;
+}
+
+static void print_json_string( char const * string ) {
+		putchar( '"' );
+		for ( char const * it = string; *it; ++it ) {
+				unsigned char c = (unsigned char)*it;
+				if ( c == '"' || c == '\\' ) {
+						printf( "\\%c", c );
+				} else if ( c < 0x20 ) {
+						printf( "\\u%04x", c );
+				} else {
+						putchar( c );
+				}
+		}
+		putchar( '"' );
+}
+
+static void print_flash_stats_json( tek_flash_job const * job ) {
+		char port_path_string[USB_PORT_PATH_STRING_SZ];
+		upload_stats const * stats = &job->upload_stats;
+
+		printf( "{\"device\":\"%s\",\"result\":\"%s\",\"error\":"
+		      , format_usb_port_path( &job->port_path, port_path_string ), job->error ? "error" : "ok"
+		      );
+		if ( job->error ) {
+				print_json_string( job->error );
+		} else {
+				printf( "null" );
+		}
+		printf( ",\"phases_ms\":{" );
+		for ( size_t phase = 0; phase < FLASH_PHASES_COUNT; ++phase ) {
+				printf( "%s\"%s\":%.3f", phase ? "," : "", flash_phase_names[phase], job->phase_ns[phase] / 1e6 );
+		}
+		printf( "},\"upload\":{\"pages\":%zu,\"pages_skipped\":%zu,\"pages_resumed\":%zu"
+		        ",\"pages_verified\":%zu,\"pages_read_back\":%zu"
+		      , stats->pages_count, stats->pages_skipped, stats->pages_resumed
+		      , stats->pages_verified, stats->pages_read_back
+		      );
+		printf( ",\"transfers\":%zu,\"bytes\":%zu,\"bytes_per_s\":%.0f"
+		      , stats->transfers_count, stats->bytes_sent
+		      , upload_bytes_per_second( job )
+		      );
+		printf( ",\"transfers_failed\":%zu,\"transfers_retried\":%zu,\"pages_retried\":%zu"
+		        ",\"chunk_resizes\":%zu,\"min_chunk_bytes\":%zu"
+		      , stats->transfers_failed, stats->transfers_retried, stats->pages_retried
+		      , stats->chunk_resizes, stats->min_chunk_sz
+		      );
+		printf( ",\"latency_us_histogram\":[" );
+		for ( size_t bucket = 0; bucket < UPLOAD_LATENCY_BUCKETS; ++bucket ) {
+				printf( "%s%zu", bucket ? "," : "", stats->latency_histogram[bucket] );
+		}
+		printf( "]}}\n" );
+}
+
+static void print_flash_stats_table( tek_flash_job const * job ) {
+		upload_stats const * stats = &job->upload_stats;
+
+		printf( "%s%-24s %12s\n", job->log_prefix, "Phase", "Time (ms)" );
+		uint64_t total_ns = 0;
+		for ( size_t phase = 0; phase < FLASH_PHASES_COUNT; ++phase ) {
+				printf( "%s%-24s %12.3f\n", job->log_prefix, flash_phase_names[phase], job->phase_ns[phase] / 1e6 );
+				total_ns += job->phase_ns[phase];
+		}
+		printf( "%s%-24s %12.3f\n", job->log_prefix, "total", total_ns / 1e6 );
+		printf( "%sUploaded %zu bytes in %zu transfers at %.0f bytes/s\n"
+		      , job->log_prefix, stats->bytes_sent, stats->transfers_count, upload_bytes_per_second( job )
+		      );
+		if ( stats->pages_resumed ) {
+				printf( "%s  %zu of %zu pages resumed from the journal\n", job->log_prefix, stats->pages_resumed, stats->pages_count );
+		}
+		if ( stats->transfers_failed || stats->chunk_resizes ) {
+				printf( "%s  %zu failed, %zu pages retried with %zu transfers, %zu resizes down to %zu bytes\n"
+				      , job->log_prefix, stats->transfers_failed, stats->pages_retried, stats->transfers_retried
+				      , stats->chunk_resizes, stats->min_chunk_sz
+				      );
+		}
+		for ( size_t bucket = 0; bucket < UPLOAD_LATENCY_BUCKETS; ++bucket ) {
+				if ( !stats->latency_histogram[bucket] ) {   continue;   }
+				printf( "%s  latency %s%8llu us: %zu\n", job->log_prefix
+				      , bucket == UPLOAD_LATENCY_BUCKETS - 1 ? ">=" : "< "
+				      , bucket == UPLOAD_LATENCY_BUCKETS - 1 ? 1ull << bucket : 1ull << (bucket+1)
+				      , stats->latency_histogram[bucket]
+				      );
+		}
+}
+
+void print_flash_stats( tek_flash_job const * job, enum stats_format_t stats_format ) {
+		switch ( stats_format ) {
+			case STATS_NONE:                                    break;
+			case STATS_TABLE: print_flash_stats_table( job );   break;
+			case STATS_JSON:  print_flash_stats_json( job );    break;
+		}
+}
+
+// Busy time counts while at least one upload runs behind the hub
+void print_hub_stats( tekflash_context * context, enum stats_format_t stats_format ) {
+		if ( stats_format == STATS_NONE ) {   return;   }
+
+		upload_hub_scheduler * upload_hubs = &context->hubs;
+		pthread_mutex_lock( &upload_hubs->mutex );
+		if ( stats_format == STATS_TABLE ) {
+				printf( "%-16s %8s %10s %12s %12s %6s %6s\n", "Hub", "Uploads", "Bytes", "Busy (ms)", "Bytes/s", "Slots", "Peak" );
+		}
+		for ( size_t i = 0; i < upload_hubs->hubs_count; ++i ) {
+				upload_hub const * hub = &upload_hubs->hubs[i];
+				char hub_path_string[USB_PORT_PATH_STRING_SZ];
+				format_usb_port_path( &hub->hub_path, hub_path_string );
+				double bytes_per_second = hub->busy_ns ? hub->bytes_sent * 1e9 / hub->busy_ns : 0.0;
+				if ( stats_format == STATS_TABLE ) {
+						printf( "%-16s %8zu %10zu %12.3f %12.0f %6zu %6zu\n", hub_path_string, hub->uploads_count
+						      , hub->bytes_sent, hub->busy_ns / 1e6, bytes_per_second, hub->slots, hub->peak_active
+						      );
+				} else {
+						printf( "{\"hub\":\"%s\",\"uploads\":%zu,\"bytes\":%zu,\"busy_ms\":%.3f,\"bytes_per_s\":%.0f"
+						        ",\"slots\":%zu,\"peak_active\":%zu}\n"
+						      , hub_path_string, hub->uploads_count, hub->bytes_sent, hub->busy_ns / 1e6
+						      , bytes_per_second, hub->slots, hub->peak_active
+						      );
+				}
+		}
+		pthread_mutex_unlock( &upload_hubs->mutex );
+}
+
+//=== Firmware upload ===//
+
+// ISP commands of the upload pipeline, one control transfer per page erase and per
+// chunk read or written, with the flash address in wValue, and one per state switch,
+// with the state in wValue, as the simulated bootloader of the benchmarks, dry runs
+// and diffs answers them
+// The datasheet in doc/ only says the MG84FL54B ISP code is reached through USB DFU
+// and leaves its commands to the Megawin development kit, so no backend talks to a
+// real keyboard yet and flashing one is refused before anything is sent
+#define TEK_ISP_REQUEST_TYPE_OUT  ( LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT )
+#define TEK_ISP_REQUEST_TYPE_IN   ( LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN )
+#define TEK_ISP_REQUEST_WRITE        0x01
+#define TEK_ISP_REQUEST_READ         0x02
+#define TEK_ISP_REQUEST_ERASE_PAGE   0x03
+#define TEK_ISP_REQUEST_SWITCH_STATE 0x04
+// Full speed control endpoint max packet size
+#define TEK_ISP_CHUNK_SZ         64
+#define TEK_ISP_TIMEOUT_MS       1000
+
+// Writes are halved down to TEK_ISP_MIN_CHUNK_SZ when a page has to be retried or
+// transfers get slow compared to the timeout, and doubled back after a few clean pages
+#define TEK_ISP_MIN_CHUNK_SZ     8
+#define TEK_ISP_GROW_AFTER_PAGES 4
+#define TEK_ISP_SLOW_LATENCY_NS  ( TEK_ISP_TIMEOUT_MS * UINT64_C(1000000) / 4 )
+// A failed page is programmed again at most this many times, after waiting
+// TEK_ISP_RETRY_BACKOFF_MS the first time and twice as long each next time
+#define TEK_ISP_MAX_PAGE_RETRIES 3
+#define TEK_ISP_RETRY_BACKOFF_MS 10
+
+// ISP commands go through a backend, the one of the simulated device is the only one
+typedef struct {
+		int (* submit_transfer)( struct libusb_transfer * transfer );
+		int (* control_transfer)( libusb_device_handle * usb_device_handle, uint8_t request_type, uint8_t request
+		                        , uint16_t value, uint16_t index, unsigned char * data, uint16_t length
+		                        , unsigned int timeout_ms
+		                        );
+} isp_backend;
+
+static isp_backend const * tek_isp_backend = NULL;
+
+static char const * check_isp_backend( void ) {
+		if ( !tek_isp_backend ) {
+				return "ISP protocol not supported yet, the commands of the TEK bootloader are not known";
+		}
+		return NULL;
+}
+
+// Completion callbacks of every job of a context run on this single thread
+static void * handle_usb_events( void * context_ptr ) {
+		tekflash_context * context = context_ptr;
+		while ( !atomic_load( &context->usb_event_thread_stop ) ) {
+				struct timeval timeout = { .tv_sec = 0, .tv_usec = 100000 };
+				libusb_handle_events_timeout_completed( context->usb_context, &timeout, NULL );
+		}
+		return NULL;
+}
+
+static char const * start_usb_event_thread( tekflash_context * context ) {
+		atomic_store( &context->usb_event_thread_stop, false );
+		if ( pthread_create( &context->usb_event_thread, NULL, handle_usb_events, context ) != 0 ) {
+				return "Unable to start usb event thread";
+		}
+		return NULL;
+}
+
+static void stop_usb_event_thread( tekflash_context * context ) {
+		atomic_store( &context->usb_event_thread_stop, true );
+		libusb_interrupt_event_handler( context->usb_context );
+		pthread_join( context->usb_event_thread, NULL );
+}
+
+// Pages erased and programmed by an upload, in order
+typedef struct {
+		size_t pages_count;
+		ui16   page_addrs[IHEX_PAGES_COUNT];
+} upload_plan;
+
+// One ISP command, sent from a frame of the image when it has one, otherwise
+// staged in the buffer of its upload slot
+typedef struct {
+		ui8         request;
+		ui16        addr;
+		ui16        size;
+		ui8 const * opt_frame;
+} isp_operation;
+
+// Commands programming one page: its erase, then its writes at the chunk size
+// the upload was at when the page came up
+#define ISP_MAX_PAGE_OPERATIONS ( 1 + TEK_FLASH_PAGE_SZ / TEK_ISP_MIN_CHUNK_SZ )
+typedef struct {
+		size_t        operations_count;
+		isp_operation operations[ISP_MAX_PAGE_OPERATIONS];
+} isp_page_operations;
+
+// Synchronous, only the verify after an upload reads back page by page this way
+static char const * read_flash_from_dev( libusb_device_handle * usb_device_handle, size_t addr, ui8 * data, size_t size ) {
+		for ( size_t offset = 0; offset < size; offset += TEK_ISP_CHUNK_SZ ) {
+				size_t chunk_sz = size - offset;
+				if ( chunk_sz > TEK_ISP_CHUNK_SZ ) {   chunk_sz = TEK_ISP_CHUNK_SZ;   }
+				int status = tek_isp_backend->control_transfer( usb_device_handle, TEK_ISP_REQUEST_TYPE_IN, TEK_ISP_REQUEST_READ
+				                                              , (ui16)(addr + offset), 0, data + offset, (ui16)chunk_sz
+				                                              , TEK_ISP_TIMEOUT_MS
+				                                              );
+				if ( status < 0 ) {
+						return format_error( "Read back failed at address 0x%04zx: %s (%s)"
+						                   , addr + offset, libusb_strerror( status ), libusb_error_name( status )
+						                   );
+				}
+				if ( (size_t)status != chunk_sz ) {
+						return format_error( "Short read back at address 0x%04zx", addr + offset );
+				}
+		}
+		return NULL;
+}
+
+// Erase and program every page holding data records, or with delta only those
+// whose current flash contents differ from the image
+// Chunks are aligned on coverage words, only the span between the first and last
+// covered byte of a chunk is written; gaps inside it hold 0xFF, a no-op on erased flash
+_Static_assert( TEK_ISP_CHUNK_SZ == IHEX_COVERAGE_WORD_BITS, "Upload chunks map to image coverage words" );
+
+// Writes go from the first to the last covered byte of a chunk, gaps in between are 0xFF
+static void get_chunk_write_range( uint64_t coverage, size_t * first, size_t * size ) {
+		size_t last = IHEX_COVERAGE_WORD_BITS - 1 - (size_t)__builtin_clzll( coverage );
+		*first = (size_t)__builtin_ctzll( coverage );
+		*size  = last - *first + 1;
+}
+
+// The journal is stored before anything gets erased, every page of the plan loses
+// its verified bit until it is committed again
+static char const * plan_upload( ihex_image const * image, upload_journal * opt_journal
+                               , upload_plan * plan, upload_stats * stats
+                               ) {
+		plan->pages_count = 0;
+		for ( size_t page_addr = 0; page_addr < image->highest_addr; page_addr += TEK_FLASH_PAGE_SZ ) {
+				if ( !is_image_page_covered( image, page_addr ) ) {   continue;   }
+				stats->pages_count += 1;
+
+				uint32_t page_bit = UINT32_C(1) << (page_addr / TEK_FLASH_PAGE_SZ);
+				if ( opt_journal && (opt_journal->state.committed_pages & page_bit) ) {
+						stats->pages_resumed += 1;
+						continue;
+				}
+
+				if ( opt_journal ) {   opt_journal->state.verified_pages &= ~page_bit;   }
+				plan->page_addrs[plan->pages_count++] = (ui16)page_addr;
+		}
+		return opt_journal ? store_upload_journal( opt_journal ) : NULL;
+}
+
+// At full chunk size every write has its frame in the image, smaller ones split
+// the covered span of a chunk and skip the pieces holding no data at all
+static void plan_page_operations( ihex_image const * image, size_t page_addr, size_t chunk_sz
+                                , isp_page_operations * page_operations
+                                ) {
+		isp_operation * operations = page_operations->operations;
+		size_t count = 0;
+		operations[count++] = (isp_operation){ TEK_ISP_REQUEST_ERASE_PAGE, (ui16)page_addr, 0
+		                                     , image->erase_frames[page_addr / TEK_FLASH_PAGE_SZ]
+		                                     };
+		for ( size_t chunk_addr = page_addr; chunk_addr < page_addr + TEK_FLASH_PAGE_SZ; chunk_addr += TEK_ISP_CHUNK_SZ ) {
+				uint64_t coverage = image_coverage_word( image, chunk_addr );
+				if ( !coverage ) {   continue;   }
+				size_t first, size;
+				get_chunk_write_range( coverage, &first, &size );
+				if ( chunk_sz == TEK_ISP_CHUNK_SZ ) {
+						operations[count++] = (isp_operation){ TEK_ISP_REQUEST_WRITE, (ui16)(chunk_addr + first), (ui16)size
+						                                     , image->write_frames[chunk_addr / TEK_ISP_CHUNK_SZ]
+						                                     };
+						continue;
+				}
+				for ( size_t offset = first; offset < first + size; offset += chunk_sz ) {
+						size_t piece_sz = first + size - offset < chunk_sz ? first + size - offset : chunk_sz;
+						if ( !((coverage >> offset) & ((UINT64_C(1) << piece_sz) - 1)) ) {   continue;   }
+						operations[count++] = (isp_operation){ TEK_ISP_REQUEST_WRITE, (ui16)(chunk_addr + offset), (ui16)piece_sz, NULL };
+				}
+		}
+		page_operations->operations_count = count;
+}
+
+void prepare_image_transfers( ihex_image * image ) {
+		for ( size_t chunk = 0; chunk < IHEX_COVERAGE_WORDS_COUNT; ++chunk ) {
+				uint64_t coverage = image->coverage[chunk];
+				if ( !coverage ) {   continue;   }
+				size_t first, size;
+				get_chunk_write_range( coverage, &first, &size );
+				size_t addr = chunk * TEK_ISP_CHUNK_SZ + first;
+				ui8 * frame = image->write_frames[chunk];
+				libusb_fill_control_setup( frame, TEK_ISP_REQUEST_TYPE_OUT, TEK_ISP_REQUEST_WRITE, (ui16)addr, 0, (ui16)size );
+				memcpy( frame + LIBUSB_CONTROL_SETUP_SIZE, image->bytes + addr, size );
+		}
+		for ( size_t page = 0; page < IHEX_PAGES_COUNT; ++page ) {
+				libusb_fill_control_setup( image->erase_frames[page], TEK_ISP_REQUEST_TYPE_OUT, TEK_ISP_REQUEST_ERASE_PAGE
+				                         , (ui16)(page * TEK_FLASH_PAGE_SZ), 0, 0
+				                         );
+		}
+}
+
+typedef struct upload_pipeline upload_pipeline;
+
+typedef struct {
+		struct libusb_transfer * transfer;
+		upload_pipeline *        pipeline;
+		bool                     in_flight;
+		bool                     reading;   // a delta read back, its chunk lands in staging
+		size_t                   addr;
+		size_t                   plan_page; // index in the upload plan of the page being read or programmed
+		uint64_t                 submit_time_ns;
+		ui8                      staging[IHEX_WRITE_FRAME_SZ];
+} upload_slot;
+
+// With delta, the pages of the plan are read back ahead of programming them
+enum upload_page_state_t {
+		UPLOAD_PAGE_UNREAD,
+		UPLOAD_PAGE_MATCHING, // every chunk read back matches the image, left alone
+		UPLOAD_PAGE_DIFFERS,  // programmed, a chunk differed or could not be read back
+};
+
+#define UPLOAD_PAGE_CHUNKS_COUNT ( TEK_FLASH_PAGE_SZ / TEK_ISP_CHUNK_SZ )
+
+struct upload_pipeline {
+		pthread_mutex_t mutex;
+		pthread_cond_t  slot_completed;
+		size_t          in_flight_count;
+		int             transfer_status; // first failure since the upload last (re)started
+		size_t          failed_addr;
+		size_t          failed_plan_page; // earliest page of the plan with a failed transfer
+		uint64_t        latency_ewma_ns;
+		size_t          page_pending[IHEX_PAGES_COUNT]; // transfers in flight per page of the plan
+		ui8             page_state[IHEX_PAGES_COUNT];
+		size_t          page_chunks_matching[IHEX_PAGES_COUNT];
+		ihex_image const * image;
+		upload_stats *  stats;
+		upload_slot     slots[UPLOAD_MAX_QUEUE_DEPTH];
+};
+
+static void upload_transfer_completed( struct libusb_transfer * transfer ) {
+		upload_slot * slot = transfer->user_data;
+		upload_pipeline * pipeline = slot->pipeline;
+		uint64_t latency_ns = monotonic_time_ns() - slot->submit_time_ns;
+
+		pthread_mutex_lock( &pipeline->mutex );
+		upload_stats * stats = pipeline->stats;
+		stats->transfers_count  += 1;
+		stats->total_latency_ns += latency_ns;
+		if ( latency_ns < stats->min_latency_ns ) {   stats->min_latency_ns = latency_ns;   }
+		if ( latency_ns > stats->max_latency_ns ) {   stats->max_latency_ns = latency_ns;   }
+		stats->latency_histogram[upload_latency_bucket( latency_ns )] += 1;
+		pipeline->latency_ewma_ns = pipeline->latency_ewma_ns ? (pipeline->latency_ewma_ns * 7 + latency_ns) / 8 : latency_ns;
+		bool transferred = transfer->status == LIBUSB_TRANSFER_COMPLETED
+		                && transfer->actual_length == transfer->length - (int)LIBUSB_CONTROL_SETUP_SIZE;
+		if ( !transferred ) {   stats->transfers_failed += 1;   }
+		if ( slot->reading && transfer->status != LIBUSB_TRANSFER_NO_DEVICE ) {
+				// A chunk that could not be read back is programmed like a differing one
+				ui8 * page_state = &pipeline->page_state[slot->plan_page];
+				if ( *page_state == UPLOAD_PAGE_UNREAD ) {
+						if ( !transferred
+						  || memcmp( slot->staging + LIBUSB_CONTROL_SETUP_SIZE, pipeline->image->bytes + slot->addr, TEK_ISP_CHUNK_SZ ) != 0
+						   ) {
+								*page_state = UPLOAD_PAGE_DIFFERS;
+						} else if ( ++pipeline->page_chunks_matching[slot->plan_page] == UPLOAD_PAGE_CHUNKS_COUNT ) {
+								*page_state = UPLOAD_PAGE_MATCHING;
+								stats->pages_skipped += 1;
+						}
+				}
+		} else if ( transferred ) {
+				stats->bytes_sent += (size_t)transfer->actual_length;
+		} else {
+				if ( pipeline->transfer_status == LIBUSB_SUCCESS ) {
+						pipeline->transfer_status = transfer->status == LIBUSB_TRANSFER_TIMED_OUT ? LIBUSB_ERROR_TIMEOUT
+						                          : transfer->status == LIBUSB_TRANSFER_STALL     ? LIBUSB_ERROR_PIPE
+						                          : transfer->status == LIBUSB_TRANSFER_NO_DEVICE ? LIBUSB_ERROR_NO_DEVICE
+						                          :                                                 LIBUSB_ERROR_IO;
+						pipeline->failed_addr = slot->addr;
+				}
+				if ( slot->plan_page < pipeline->failed_plan_page ) {
+						pipeline->failed_plan_page = slot->plan_page;
+				}
+		}
+		slot->in_flight = false;
+		pipeline->in_flight_count -= 1;
+		pipeline->page_pending[slot->plan_page] -= 1;
+		pthread_cond_signal( &pipeline->slot_completed );
+		pthread_mutex_unlock( &pipeline->mutex );
+}
+
+// Called with the pipeline mutex held, before planning each page
+static size_t adapt_upload_chunk_size( upload_pipeline const * pipeline, size_t chunk_sz, size_t * clean_pages ) {
+		size_t adapted_sz = chunk_sz;
+		if ( pipeline->latency_ewma_ns > TEK_ISP_SLOW_LATENCY_NS && chunk_sz > TEK_ISP_MIN_CHUNK_SZ ) {
+				adapted_sz = chunk_sz / 2;
+		} else if ( *clean_pages >= TEK_ISP_GROW_AFTER_PAGES && chunk_sz < TEK_ISP_CHUNK_SZ ) {
+				adapted_sz = chunk_sz * 2;
+		}
+		if ( adapted_sz != chunk_sz ) {
+				*clean_pages = 0;
+				pipeline->stats->chunk_resizes += 1;
+		}
+		*clean_pages += 1;
+		return adapted_sz;
+}
+
+// Keeps up to queue_depth commands in flight, completions are handled by the usb event thread
+// Commands on the control endpoint execute in submission order, so a page erase
+// is always done before the writes queued behind it
+// With delta, the chunks of the plan are read back through the same slots: a page is
+// programmed as soon as one of its chunks differs, its other chunks are not read, and
+// left alone once they all match; writes go first, reads back fill the slots left free
+// A failed transfer stops submissions; once the transfers in flight are back, the
+// earliest page with a failure is erased and programmed again from its erase on,
+// after a backoff and with chunks half as large
+// Pages are committed in plan order, once fully submitted with nothing left in flight
+// and no failure on them; a page after a failed one is never committed before it
+char const * upload_buffer_to_dev( ihex_image const * image
+                                 , libusb_device_handle * usb_device_handle, bool delta
+                                 , size_t queue_depth, atomic_bool * opt_cancel
+                                 , upload_journal * opt_journal, upload_stats * stats
+                                 ) {
+		assert( image && usb_device_handle && stats );
+		assert( queue_depth > 0 && queue_depth <= UPLOAD_MAX_QUEUE_DEPTH );
+
+		*stats = (upload_stats){ .min_latency_ns = UINT64_MAX, .min_chunk_sz = TEK_ISP_CHUNK_SZ };
+		char const * opt_error = check_isp_backend();
+		if ( opt_error ) {   goto function_exit;   }
+
+		uint32_t verified_pages = opt_journal ? opt_journal->state.verified_pages : 0;
+		upload_plan plan;
+		char const * call_error = plan_upload( image, opt_journal, &plan, stats );
+		if ( call_error ) {
+				opt_error = call_error;
+				goto function_exit;
+		}
+
+		upload_pipeline pipeline = { .transfer_status = LIBUSB_SUCCESS, .failed_plan_page = SIZE_MAX
+		                           , .image = image, .stats = stats
+		                           };
+		memset( pipeline.page_state, delta ? UPLOAD_PAGE_UNREAD : UPLOAD_PAGE_DIFFERS, sizeof pipeline.page_state );
+		pthread_mutex_init( &pipeline.mutex, NULL );
+		pthread_cond_init( &pipeline.slot_completed, NULL );
+
+		size_t slots_count = 0;
+		for ( ; slots_count < queue_depth; ++slots_count ) {
+				upload_slot * slot = &pipeline.slots[slots_count];
+				slot->pipeline = &pipeline;
+				slot->transfer = libusb_alloc_transfer( 0 );
+				if ( !slot->transfer ) {
+						opt_error = "Unable to allocate usb transfers";
+						goto unwind_pipeline;
+				}
+				libusb_fill_control_transfer( slot->transfer, usb_device_handle, NULL
+				                            , upload_transfer_completed, slot, TEK_ISP_TIMEOUT_MS
+				                            );
+		}
+
+		pthread_mutex_lock( &pipeline.mutex );
+		isp_page_operations page_operations = { 0 };
+		size_t next_plan_page = 0;    // next page to plan operations for
+		size_t next_operation = 0;    // in page_operations, of page next_plan_page - 1
+		size_t next_read_page = 0;    // next page of the plan to read a chunk back from
+		size_t next_read_chunk = 0;
+		size_t retried_plan_pages = 0; // pages up to there are sent again after a retry
+		size_t page_retries[IHEX_PAGES_COUNT] = { 0 };
+		size_t chunk_sz = TEK_ISP_CHUNK_SZ;
+		size_t clean_pages = 0;
+		size_t committed_plan_pages = 0;
+		char const * journal_error = NULL;
+		int submit_status = LIBUSB_SUCCESS;
+		bool cancelled = false;
+		while ( true ) {
+				cancelled = opt_cancel && atomic_load( opt_cancel );
+				for ( size_t i = 0; i < slots_count; ++i ) {
+						if ( cancelled
+						  || journal_error
+						  || submit_status != LIBUSB_SUCCESS
+						  || pipeline.transfer_status != LIBUSB_SUCCESS
+						   ) {   break;   }
+						upload_slot * slot = &pipeline.slots[i];
+						if ( slot->in_flight ) {   continue;   }
+
+						if ( next_operation == page_operations.operations_count ) {
+								while ( next_plan_page < plan.pages_count && pipeline.page_state[next_plan_page] == UPLOAD_PAGE_MATCHING ) {
+										next_plan_page += 1;
+								}
+								if ( next_plan_page < plan.pages_count && pipeline.page_state[next_plan_page] == UPLOAD_PAGE_DIFFERS ) {
+										chunk_sz = adapt_upload_chunk_size( &pipeline, chunk_sz, &clean_pages );
+										if ( chunk_sz < stats->min_chunk_sz ) {   stats->min_chunk_sz = chunk_sz;   }
+										plan_page_operations( image, plan.page_addrs[next_plan_page], chunk_sz, &page_operations );
+										next_plan_page += 1;
+										next_operation = 0;
+								}
+						}
+
+						isp_operation read_back;
+						bool reading = next_operation == page_operations.operations_count;
+						if ( reading ) {
+								while ( next_read_page < plan.pages_count
+								     && (  pipeline.page_state[next_read_page] != UPLOAD_PAGE_UNREAD
+								        || next_read_chunk == UPLOAD_PAGE_CHUNKS_COUNT
+								        )
+								      ) {
+										next_read_page += 1;
+										next_read_chunk = 0;
+								}
+								if ( next_read_page == plan.pages_count ) {   break;   }
+								read_back = (isp_operation){ TEK_ISP_REQUEST_READ
+								                           , (ui16)(plan.page_addrs[next_read_page] + next_read_chunk * TEK_ISP_CHUNK_SZ)
+								                           , TEK_ISP_CHUNK_SZ, NULL
+								                           };
+						}
+						isp_operation const * operation = reading ? &read_back : &page_operations.operations[next_operation];
+
+						// libusb only reads the buffer of an out transfer, so concurrent uploads
+						// of the same image all send from its frames
+						if ( operation->opt_frame ) {
+								slot->transfer->buffer = (unsigned char *)operation->opt_frame;
+						} else {
+								libusb_fill_control_setup( slot->staging, reading ? TEK_ISP_REQUEST_TYPE_IN : TEK_ISP_REQUEST_TYPE_OUT
+								                         , operation->request, operation->addr, 0, operation->size
+								                         );
+								if ( !reading ) {
+										memcpy( slot->staging + LIBUSB_CONTROL_SETUP_SIZE, image->bytes + operation->addr, operation->size );
+								}
+								slot->transfer->buffer = slot->staging;
+						}
+						slot->transfer->length = (int)(LIBUSB_CONTROL_SETUP_SIZE + operation->size);
+
+						slot->reading = reading;
+						slot->addr = operation->addr;
+						slot->plan_page = reading ? next_read_page : next_plan_page - 1;
+						slot->submit_time_ns = monotonic_time_ns();
+						submit_status = tek_isp_backend->submit_transfer( slot->transfer );
+						if ( submit_status != LIBUSB_SUCCESS ) {
+								pipeline.failed_addr = operation->addr;
+								break;
+						}
+						if ( !reading && slot->plan_page < retried_plan_pages ) {   stats->transfers_retried += 1;   }
+						slot->in_flight = true;
+						pipeline.in_flight_count += 1;
+						pipeline.page_pending[slot->plan_page] += 1;
+						if ( reading ) {
+								next_read_chunk += 1;
+						} else {
+								next_operation += 1;
+						}
+				}
+
+				if ( opt_journal && !journal_error ) {
+						size_t submitted_plan_pages = next_plan_page - (next_operation < page_operations.operations_count);
+						if ( pipeline.failed_plan_page < submitted_plan_pages ) {   submitted_plan_pages = pipeline.failed_plan_page;   }
+						size_t newly_committed = committed_plan_pages;
+						while ( newly_committed < submitted_plan_pages && !pipeline.page_pending[newly_committed] ) {
+								uint32_t page_bit = UINT32_C(1) << (plan.page_addrs[newly_committed] / TEK_FLASH_PAGE_SZ);
+								opt_journal->state.committed_pages |= page_bit;
+								// A page left alone is still the one checked before
+								if ( pipeline.page_state[newly_committed] == UPLOAD_PAGE_MATCHING ) {
+										opt_journal->state.verified_pages |= verified_pages & page_bit;
+								}
+								newly_committed += 1;
+						}
+						if ( newly_committed != committed_plan_pages ) {
+								committed_plan_pages = newly_committed;
+								// Completions keep coming meanwhile, the journal is only touched here
+								pthread_mutex_unlock( &pipeline.mutex );
+								journal_error = store_upload_journal( opt_journal );
+								pthread_mutex_lock( &pipeline.mutex );
+								continue;
+						}
+				}
+
+				bool done = (next_plan_page == plan.pages_count && next_operation == page_operations.operations_count)
+				         || cancelled
+				         || journal_error
+				         || submit_status != LIBUSB_SUCCESS
+				         || pipeline.transfer_status != LIBUSB_SUCCESS;
+				if ( done && pipeline.in_flight_count == 0 ) {
+						size_t failed_plan_page = pipeline.failed_plan_page;
+						bool retry = pipeline.transfer_status != LIBUSB_SUCCESS
+						          && pipeline.transfer_status != LIBUSB_ERROR_NO_DEVICE
+						          && submit_status == LIBUSB_SUCCESS && !cancelled && !journal_error
+						          && page_retries[failed_plan_page] < TEK_ISP_MAX_PAGE_RETRIES;
+						if ( !retry ) {   break;   }
+
+						unsigned backoff_ms = TEK_ISP_RETRY_BACKOFF_MS << page_retries[failed_plan_page];
+						page_retries[failed_plan_page] += 1;
+						stats->pages_retried += 1;
+						if ( chunk_sz > TEK_ISP_MIN_CHUNK_SZ ) {
+								chunk_sz /= 2;
+								stats->chunk_resizes += 1;
+						}
+						clean_pages = 0;
+						pthread_mutex_unlock( &pipeline.mutex );
+						nanosleep( &(struct timespec){ .tv_sec = backoff_ms / 1000, .tv_nsec = (long)(backoff_ms % 1000) * 1000000 }, NULL );
+						pthread_mutex_lock( &pipeline.mutex );
+
+						if ( next_plan_page > retried_plan_pages ) {   retried_plan_pages = next_plan_page;   }
+						next_plan_page = failed_plan_page;
+						next_operation = page_operations.operations_count = 0;
+						pipeline.transfer_status  = LIBUSB_SUCCESS;
+						pipeline.failed_plan_page = SIZE_MAX;
+						continue;
+				}
+				pthread_cond_wait( &pipeline.slot_completed, &pipeline.mutex );
+		}
+		pthread_mutex_unlock( &pipeline.mutex );
+
+		int status = submit_status != LIBUSB_SUCCESS ? submit_status : pipeline.transfer_status;
+		if ( status != LIBUSB_SUCCESS ) {
+				stats->failed_addr       = pipeline.failed_addr;
+				stats->failed_usb_status = status;
+				size_t retries = submit_status == LIBUSB_SUCCESS ? page_retries[pipeline.failed_plan_page] : 0;
+				if ( retries ) {
+						opt_error = format_error( "Transfer failed at address 0x%04zx after %zu retries: %s (%s)"
+						                        , pipeline.failed_addr, retries, libusb_strerror( status ), libusb_error_name( status )
 						                        );
-						goto unwind_usb_devices_list;
+				} else {
+						opt_error = format_error( "Transfer failed at address 0x%04zx: %s (%s)"
+						                        , pipeline.failed_addr, libusb_strerror( status ), libusb_error_name( status )
+						                        );
+				}
+		} else if ( journal_error ) {
+				opt_error = journal_error;
+		} else if ( next_plan_page < plan.pages_count || next_operation < page_operations.operations_count ) {
+				stats->failed_addr = next_operation < page_operations.operations_count ? page_operations.operations[next_operation].addr
+				                                                                       : plan.page_addrs[next_plan_page];
+				opt_error = format_error( "Cancelled before address 0x%04zx", stats->failed_addr );
+		}
+
+	unwind_pipeline:
+		for ( size_t i = 0; i < slots_count; ++i ) {
+				libusb_free_transfer( pipeline.slots[i].transfer );
+		}
+		pthread_cond_destroy( &pipeline.slot_completed );
+		pthread_mutex_destroy( &pipeline.mutex );
+	function_exit:
+		return opt_error;
+}
+
+static char const * verify_image_pages_on_dev( ihex_image const * image
+                                             , libusb_device_handle * usb_device_handle
+                                             , upload_journal * opt_journal, upload_stats * stats
+                                             );
+
+// Every programmed page is read back and its CRC compared with the one computed
+// at load time, no bootloader command checksumming a page on the device is known
+// The journal is stored whatever the outcome, a mismatching page is no longer committed
+char const * verify_image_on_dev( ihex_image const * image
+                                , libusb_device_handle * usb_device_handle
+                                , upload_journal * opt_journal, upload_stats * stats
+                                ) {
+		assert( image && usb_device_handle && stats );
+
+		char const * opt_error = check_isp_backend();
+		if ( opt_error ) {   return opt_error;   }
+		opt_error = verify_image_pages_on_dev( image, usb_device_handle, opt_journal, stats );
+		if ( opt_journal ) {
+				// A failed store formats its own error over the one of the verify
+				char verify_error[MAX_ERROR_STRING_SZ];
+				if ( opt_error ) {   snprintf( verify_error, sizeof verify_error, "%s", opt_error );   }
+				char const * call_error = store_upload_journal( opt_journal );
+				opt_error = opt_error ? format_error( "%s", verify_error ) : call_error;
+		}
+		return opt_error;
+}
+
+static char const * verify_image_pages_on_dev( ihex_image const * image
+                                             , libusb_device_handle * usb_device_handle
+                                             , upload_journal * opt_journal, upload_stats * stats
+                                             ) {
+		for ( size_t page = 0; page < IHEX_PAGES_COUNT; ++page ) {
+				size_t page_addr = page * TEK_FLASH_PAGE_SZ;
+				if ( !is_image_page_covered( image, page_addr ) ) {   continue;   }
+				uint32_t page_bit = UINT32_C(1) << page;
+				if ( opt_journal && (opt_journal->state.verified_pages & page_bit) ) {
+						stats->pages_verified += 1;
+						continue;
+				}
+
+				ui8 flash_page[TEK_FLASH_PAGE_SZ];
+				char const * call_error = read_flash_from_dev( usb_device_handle, page_addr, flash_page, TEK_FLASH_PAGE_SZ );
+				if ( call_error ) {   return call_error;   }
+				stats->pages_read_back += 1;
+				if ( crc32_update( 0, flash_page, TEK_FLASH_PAGE_SZ ) != image->page_crcs[page] ) {
+						stats->failed_addr = page_addr;
+						if ( opt_journal ) {   opt_journal->state.committed_pages &= ~page_bit;   }
+						return format_error( "Verify failed on page at 0x%04zx", page_addr );
+				}
+				stats->pages_verified += 1;
+				if ( opt_journal ) {   opt_journal->state.verified_pages |= page_bit;   }
+		}
+		return NULL;
+}
+
+//=== Progress journal ===//
+
+// Entries hold the state in host byte order, their CRC covers everything before it
+#define UPLOAD_JOURNAL_MAGIC  "TEKJNL01"
+#define UPLOAD_JOURNAL_SUFFIX ".tekjnl"
+
+typedef struct {
+		char                 magic[8];
+		upload_journal_state state;
+		uint32_t             crc;
+} upload_journal_entry;
+
+bool open_upload_journal( char const * journal_dir, usb_port_path const * port_path, char const * serial
+                        , ihex_image const * image, upload_journal * journal
+                        ) {
+		assert( journal_dir && port_path && serial && image && journal );
+		if ( !serial[0] ) {   return false;   }
+
+		// Characters a file name cannot hold are replaced, the stored serial tells
+		// apart serial numbers that end up with the same name
+		char file_serial[UPLOAD_JOURNAL_SERIAL_SZ];
+		for ( size_t i = 0; i < sizeof file_serial; ++i ) {
+				char c = serial[i];
+				bool allowed = (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '-' || c == '_';
+				file_serial[i] = !c || allowed ? c : '_';
+				if ( !c ) {   break;   }
+		}
+		char port_path_string[USB_PORT_PATH_STRING_SZ];
+		snprintf( journal->path, sizeof journal->path, "%s/%s_%s" UPLOAD_JOURNAL_SUFFIX
+		        , journal_dir, format_usb_port_path( port_path, port_path_string ), file_serial
+		        );
+		journal->state = (upload_journal_state){ .image_crc = image->crc, .highest_addr = (uint32_t)image->highest_addr };
+		snprintf( journal->state.serial, sizeof journal->state.serial, "%s", serial );
+
+		int journal_fd = open( journal->path, O_RDONLY );
+		if ( journal_fd < 0 ) {   return true;   }
+		upload_journal_entry entry;
+		ssize_t read_sz = read( journal_fd, &entry, sizeof entry );
+		close( journal_fd );
+		if ( read_sz != (ssize_t)sizeof entry ) {   return true;   }
+
+		upload_journal_state const * stored = &entry.state;
+		bool matches = memcmp( entry.magic, UPLOAD_JOURNAL_MAGIC, sizeof entry.magic ) == 0
+		            && entry.crc == crc32_update( 0, &entry, sizeof entry - sizeof entry.crc )
+		            && memchr( stored->serial, '\0', sizeof stored->serial )
+		            && stored->image_crc == journal->state.image_crc
+		            && stored->highest_addr == journal->state.highest_addr
+		            && strcmp( stored->serial, serial ) == 0;
+		if ( !matches ) {   return true;   }
+
+		journal->state.committed_pages = stored->committed_pages;
+		journal->state.verified_pages  = stored->verified_pages & stored->committed_pages;
+		return true;
+}
+
+// Synced then renamed over the previous entry, a power loss leaves either one whole
+char const * store_upload_journal( upload_journal const * journal ) {
+		char const * opt_error = NULL;
+
+		upload_journal_entry entry = { .state = journal->state };
+		memcpy( entry.magic, UPLOAD_JOURNAL_MAGIC, sizeof entry.magic );
+		entry.crc = crc32_update( 0, &entry, sizeof entry - sizeof entry.crc );
+
+		char temporary_path[UPLOAD_JOURNAL_PATH_SZ + 16];
+		snprintf( temporary_path, sizeof temporary_path, "%s.XXXXXX", journal->path );
+
+		int journal_fd = mkstemp( temporary_path );
+		if ( journal_fd < 0 ) {
+				opt_error = format_error( "Unable to create journal \"%s\": %s", temporary_path, strerror( errno ) );
+				goto function_exit;
+		}
+		if ( fchmod( journal_fd, 0644 ) < 0 ) {
+				opt_error = format_error( "Unable to create journal \"%s\": %s", temporary_path, strerror( errno ) );
+				goto unwind_temporary_file;
+		}
+		char const * call_error = write_whole_file( journal_fd, &entry, sizeof entry );
+		if ( !call_error && fsync( journal_fd ) < 0 ) {   call_error = strerror( errno );   }
+		if ( call_error ) {
+				opt_error = format_error( "Unable to write journal \"%s\": %s", temporary_path, call_error );
+				goto unwind_temporary_file;
+		}
+		if ( close( journal_fd ) < 0 || rename( temporary_path, journal->path ) < 0 ) {
+				opt_error = format_error( "Unable to store journal \"%s\": %s", journal->path, strerror( errno ) );
+				unlink( temporary_path );
+		}
+		goto function_exit;
+
+	unwind_temporary_file:
+		close( journal_fd );
+		unlink( temporary_path );
+	function_exit:
+		return opt_error;
+}
+
+// Once the keyboard runs the new firmware, a rerun has nothing to resume
+void remove_upload_journal( upload_journal const * journal ) {
+		unlink( journal->path );
+}
+
+//=== TEK flashing jobs ===//
+
+static void log_tek_event( tek_flash_job * job, enum flash_phase_t phase, enum tek_event_code_t code
+                         , int usb_status, size_t value, size_t extra
+                         );
+
+static bool is_tek_flash_job_cancelled( tek_flash_job const * job ) {
+		return job->opt_cancel && atomic_load( job->opt_cancel );
+}
+
+static void finish_tek_upload_stage( tek_flash_job * job ) {
+		if ( job->upload_stage_done ) {   return;   }
+		job->upload_stage_done = true;
+		if ( job->opt_upload_done ) {   job->opt_upload_done( job );   }
+}
+
+static char const * switch_tek_device_state( libusb_device_handle * tek_device_handle
+                                           , enum tek_device_state_t tek_device_state
+                                           ) {
+		char const * opt_error = check_isp_backend();
+		if ( opt_error ) {   return opt_error;   }
+
+		int status = tek_isp_backend->control_transfer( tek_device_handle, TEK_ISP_REQUEST_TYPE_OUT, TEK_ISP_REQUEST_SWITCH_STATE
+		                                              , (ui16)tek_device_state, 0, NULL, 0, TEK_ISP_TIMEOUT_MS
+		                                              );
+		// The keyboard may already be re-enumerating when the status stage would come
+		if ( status < 0 && status != LIBUSB_ERROR_NO_DEVICE ) {
+				return format_error( "Switch request failed: %s (%s)", libusb_strerror( status ), libusb_error_name( status ) );
+		}
+		return NULL;
+}
+
+// Runs the whole state machine of a single keyboard, usable as a thread entry point
+// Errors are copied into the job since format_error storage does not outlive the thread
+static void * flash_tek_device( void * tek_flash_job_ ) {
+		tek_flash_job * job = tek_flash_job_;
+		char const * opt_error = NULL;
+		enum flash_phase_t phase = FLASH_PHASE_ENUMERATION;
+
+		libusb_device_handle * tek_device_handle;
+		enum tek_device_state_t tek_device_state = TEK_NORMAL_STATE;
+		tek_device_profile const * profile;
+		char const * call_error = get_handle_to_tek_device( job->context, &job->port_path, &tek_device_handle, &tek_device_state, &profile );
+		if ( call_error ) {
+				opt_error = format_error( "Unable to connect to the TEK: %s", call_error );
+				goto function_exit;
+		}
+		if ( tek_device_state != TEK_NORMAL_STATE ) {
+				opt_error = "Found TEK, but is not in normal mode";
+				goto unwind_tek_device_handle;
+		}
+		if ( is_tek_flash_job_cancelled( job ) ) {
+				opt_error = "Cancelled, the TEK was left untouched";
+				goto unwind_tek_device_handle;
+		}
+		// Refused before the switch, so that the keyboard is not left in programmable mode
+		call_error = check_isp_backend();
+		if ( call_error ) {
+				opt_error = format_error( "Unable to flash the TEK, it was left untouched: %s", call_error );
+				goto unwind_tek_device_handle;
+		}
+		// Read while in normal mode, the bootloader may not report it
+		char serial[UPLOAD_JOURNAL_SERIAL_SZ] = "";
+		if ( job->opt_journal_dir ) {
+				struct libusb_device_descriptor usb_device_descriptor;
+				if ( libusb_get_device_descriptor( libusb_get_device( tek_device_handle ), &usb_device_descriptor ) < 0
+				  || read_tek_serial_number( tek_device_handle, usb_device_descriptor.iSerialNumber, serial, sizeof serial )
+				   ) {
+						serial[0] = '\0';
+				}
+		}
+
+		phase = FLASH_PHASE_SWITCH_TO_PROGRAMMABLE;
+		log_tek_event( job, phase, TEK_EVENT_FOUND, 0, 0, 0 );
+
+		uint64_t phase_start_ns = monotonic_time_ns();
+		call_error = switch_tek_device_state( tek_device_handle, TEK_PROGRAMMABLE_STATE );
+		job->phase_ns[FLASH_PHASE_SWITCH_TO_PROGRAMMABLE] = monotonic_time_ns() - phase_start_ns;
+		if ( call_error ) {
+				opt_error = format_error( "Unable to switch the TEK to programmable mode: %s", call_error );
+				goto unwind_tek_device_handle;
+		}
+
+		phase = FLASH_PHASE_REENUMERATION;
+		log_tek_event( job, phase, TEK_EVENT_SWITCH_SENT, 0, 0, 0 );
+
+		phase_start_ns = monotonic_time_ns();
+		// Referenced so that no re-enumerated device can be allocated at its address
+		libusb_device * previous_device = libusb_ref_device( libusb_get_device( tek_device_handle ) );
+		libusb_close( tek_device_handle );
+		call_error = wait_for_tek_device( job->context, &job->port_path, previous_device, TEK_PROGRAMMABLE_STATE
+		                                , job->reconnect_timeout_ms, &tek_device_handle
+		                                );
+		libusb_unref_device( previous_device );
+		job->phase_ns[FLASH_PHASE_REENUMERATION] = monotonic_time_ns() - phase_start_ns;
+		if ( call_error ) {
+				opt_error = format_error( "Unable to reconnect to the TEK: %s", call_error );
+				goto function_exit;
+		}
+
+		log_tek_event( job, phase, TEK_EVENT_RECONNECTED, 0, 0, 0 );
+
+		if ( job->opt_loader ) {
+				phase = FLASH_PHASE_LOAD_WAIT;
+				phase_start_ns = monotonic_time_ns();
+				call_error = wait_for_image_loader( job->opt_loader, &job->phase_ns[FLASH_PHASE_LOAD] );
+				job->phase_ns[FLASH_PHASE_LOAD_WAIT] = monotonic_time_ns() - phase_start_ns;
+				if ( call_error ) {
+						// Nothing was written, the keyboard only has to go back to normal mode
+						log_tek_event( job, phase, TEK_EVENT_ABORTED, 0, 0, 0 );
+						switch_tek_device_state( tek_device_handle, TEK_NORMAL_STATE );
+						opt_error = format_error( "Firmware file did not load, nothing was sent: %s", call_error );
+						goto unwind_tek_device_handle;
+				}
+		}
+		if ( is_tek_flash_job_cancelled( job ) ) {
+				log_tek_event( job, phase, TEK_EVENT_CANCELLED, 0, 0, 0 );
+				switch_tek_device_state( tek_device_handle, TEK_NORMAL_STATE );
+				opt_error = "Cancelled, nothing was sent";
+				goto unwind_tek_device_handle;
+		}
+		if ( job->image->highest_addr > profile->flash_sz ) {
+				log_tek_event( job, phase, TEK_EVENT_TOO_LARGE, 0, job->image->highest_addr, profile->flash_sz );
+				switch_tek_device_state( tek_device_handle, TEK_NORMAL_STATE );
+				opt_error = format_error( "Firmware does not fit in the %zu bytes of flash of a %s, nothing was sent"
+				                        , profile->flash_sz, profile->name
+				                        );
+				goto unwind_tek_device_handle;
+		}
+
+		upload_journal * opt_journal = NULL;
+		if ( job->opt_journal_dir ) {
+				if ( open_upload_journal( job->opt_journal_dir, &job->port_path, serial, job->image, &job->journal ) ) {
+						opt_journal = &job->journal;
+				} else {
+						log_tek_event( job, phase, TEK_EVENT_NOT_JOURNALED, 0, 0, 0 );
+				}
+		}
+
+		phase = FLASH_PHASE_HUB_WAIT;
+		job->phase_ns[FLASH_PHASE_HUB_WAIT] = acquire_upload_hub_slot( job->context, &job->port_path );
+
+		phase = FLASH_PHASE_UPLOAD;
+		log_tek_event( job, phase, TEK_EVENT_UPLOAD_STARTED, 0, 0, 0 );
+		phase_start_ns = monotonic_time_ns();
+		call_error = upload_buffer_to_dev( job->image, tek_device_handle, job->delta
+		                                 , job->queue_depth, job->opt_cancel, opt_journal, &job->upload_stats
+		                                 );
+		job->phase_ns[FLASH_PHASE_UPLOAD] = monotonic_time_ns() - phase_start_ns;
+		release_upload_hub_slot( job->context, &job->port_path, job->upload_stats.bytes_sent, job->phase_ns[FLASH_PHASE_UPLOAD] );
+		finish_tek_upload_stage( job );
+		upload_stats const * stats = &job->upload_stats;
+		if ( stats->pages_resumed ) {
+				log_tek_event( job, phase, TEK_EVENT_RESUMED, 0, stats->pages_resumed, stats->pages_count );
+		}
+		if ( call_error ) {
+				if ( stats->failed_usb_status ) {
+						log_tek_event( job, phase, TEK_EVENT_TRANSFER_FAILED, stats->failed_usb_status, stats->failed_addr, 0 );
+				}
+				opt_error = format_error( "Unable to upload buffer to device: %s", call_error );
+				goto unwind_tek_device_handle;
+		}
+
+		if ( job->delta ) {
+				log_tek_event( job, phase, TEK_EVENT_PAGES_SKIPPED, 0, stats->pages_skipped, stats->pages_count );
+		}
+		if ( stats->transfers_count ) {
+				log_tek_event( job, phase, TEK_EVENT_UPLOAD_DONE, 0, stats->bytes_sent, stats->transfers_count );
+		}
+		if ( stats->pages_retried ) {
+				log_tek_event( job, phase, TEK_EVENT_PAGES_RETRIED, 0, stats->pages_retried, stats->transfers_failed );
+		}
+
+		if ( job->verify ) {
+				phase = FLASH_PHASE_VERIFY;
+				phase_start_ns = monotonic_time_ns();
+				call_error = verify_image_on_dev( job->image, tek_device_handle, opt_journal, &job->upload_stats );
+				job->phase_ns[FLASH_PHASE_VERIFY] = monotonic_time_ns() - phase_start_ns;
+				if ( call_error ) {
+						log_tek_event( job, phase, TEK_EVENT_VERIFY_FAILED, 0, stats->failed_addr, 0 );
+						opt_error = format_error( "Unable to verify firmware on device: %s", call_error );
+						goto unwind_tek_device_handle;
+				}
+				log_tek_event( job, phase, TEK_EVENT_VERIFIED, 0, stats->pages_verified, stats->pages_read_back );
+		}
+
+		phase = FLASH_PHASE_SWITCH_TO_NORMAL;
+		log_tek_event( job, phase, TEK_EVENT_SWITCHING_BACK, 0, 0, 0 );
+
+		phase_start_ns = monotonic_time_ns();
+		call_error = switch_tek_device_state( tek_device_handle, TEK_NORMAL_STATE );
+		job->phase_ns[FLASH_PHASE_SWITCH_TO_NORMAL] = monotonic_time_ns() - phase_start_ns;
+		if ( call_error ) {
+				opt_error = format_error( "Unable to switch the TEK back to normal mode: %s", call_error );
+				goto unwind_tek_device_handle;
+		}
+		if ( opt_journal ) {   remove_upload_journal( opt_journal );   }
+
+		// Other keyboards upload meanwhile, only this job waits for the reboot
+		phase = FLASH_PHASE_NORMAL_REENUMERATION;
+		phase_start_ns = monotonic_time_ns();
+		previous_device = libusb_ref_device( libusb_get_device( tek_device_handle ) );
+		libusb_close( tek_device_handle );
+		call_error = wait_for_tek_device( job->context, &job->port_path, previous_device, TEK_NORMAL_STATE
+		                                , job->reconnect_timeout_ms, &tek_device_handle
+		                                );
+		libusb_unref_device( previous_device );
+		job->phase_ns[FLASH_PHASE_NORMAL_REENUMERATION] = monotonic_time_ns() - phase_start_ns;
+		if ( call_error ) {
+				opt_error = format_error( "Flashed, but the TEK did not come back in normal mode: %s", call_error );
+				goto function_exit;
+		}
+		log_tek_event( job, phase, TEK_EVENT_BACK_TO_NORMAL, 0, 0, 0 );
+
+	unwind_tek_device_handle:
+		libusb_close( tek_device_handle );
+	function_exit:
+		if ( opt_error ) {
+				snprintf( job->error_buffer, MAX_ERROR_STRING_SZ, "%s", opt_error );
+				job->error = job->error_buffer;
+				log_tek_event( job, phase, TEK_EVENT_FAILED, 0, 0, 0 );
+		}
+		finish_tek_upload_stage( job );
+		return NULL;
+}
+
+static void format_tek_event( tek_flash_job const * job, tek_event const * event, char * text, size_t text_sz ) {
+		upload_stats const * stats = &job->upload_stats;
+		switch ( (enum tek_event_code_t)event->code ) {
+			case TEK_EVENT_FOUND:
+				snprintf( text, text_sz, "TEK found, switching to programmable mode." );
+				break;
+			case TEK_EVENT_SWITCH_SENT:
+				snprintf( text, text_sz, "Command sent, trying to reconnect." );
+				break;
+			case TEK_EVENT_RECONNECTED:
+				snprintf( text, text_sz, "TEK successfully switched to programmable mode." );
+				break;
+			case TEK_EVENT_UPLOAD_STARTED:
+				snprintf( text, text_sz, "Sending new firmware to device." );
+				break;
+			case TEK_EVENT_PAGES_SKIPPED:
+				snprintf( text, text_sz, "Skipped %" PRIu32 " out of %" PRIu32 " flash pages already up to date."
+				        , event->value, event->extra
+				        );
+				break;
+			case TEK_EVENT_UPLOAD_DONE:
+				snprintf( text, text_sz, "Sent %" PRIu32 " bytes in %" PRIu32 " transfers, latency avg %.3f ms, min %.3f ms, max %.3f ms."
+				        , event->value, event->extra, stats->total_latency_ns / 1e6 / event->extra
+				        , stats->min_latency_ns / 1e6, stats->max_latency_ns / 1e6
+				        );
+				break;
+			case TEK_EVENT_PAGES_RETRIED:
+				snprintf( text, text_sz, "Retried %" PRIu32 " pages after %" PRIu32 " failed transfers, writes went down to %zu bytes."
+				        , event->value, event->extra, stats->min_chunk_sz
+				        );
+				break;
+			case TEK_EVENT_NOT_JOURNALED:
+				snprintf( text, text_sz, "TEK has no readable serial number, its progress is not journaled." );
+				break;
+			case TEK_EVENT_RESUMED:
+				snprintf( text, text_sz, "Resumed from the journal, %" PRIu32 " of %" PRIu32 " pages were already programmed."
+				        , event->value, event->extra
+				        );
+				break;
+			case TEK_EVENT_TRANSFER_FAILED:
+				snprintf( text, text_sz, "Transfer failed at address 0x%04" PRIx32 ": %s (%s)."
+				        , event->value, libusb_strerror( event->usb_status ), libusb_error_name( event->usb_status )
+				        );
+				break;
+			case TEK_EVENT_VERIFIED:
+				snprintf( text, text_sz, "Verified %" PRIu32 " flash pages, %" PRIu32 " read back.", event->value, event->extra );
+				break;
+			case TEK_EVENT_VERIFY_FAILED:
+				snprintf( text, text_sz, "Verify failed on page at 0x%04" PRIx32 ".", event->value );
+				break;
+			case TEK_EVENT_SWITCHING_BACK:
+				snprintf( text, text_sz, "Firmware sent, switching back to normal mode." );
+				break;
+			case TEK_EVENT_BACK_TO_NORMAL:
+				snprintf( text, text_sz, "TEK is back in normal mode." );
+				break;
+			case TEK_EVENT_ABORTED:
+				snprintf( text, text_sz, "Firmware file did not load, switching back to normal mode." );
+				break;
+			case TEK_EVENT_CANCELLED:
+				snprintf( text, text_sz, "Cancelled, switching back to normal mode." );
+				break;
+			case TEK_EVENT_TOO_LARGE:
+				snprintf( text, text_sz, "Firmware reaches 0x%04" PRIx32 ", past the %" PRIu32 " bytes of flash, switching back to normal mode."
+				        , event->value, event->extra
+				        );
+				break;
+			case TEK_EVENT_FAILED:
+				snprintf( text, text_sz, "Failed during the %s phase.", flash_phase_names[event->phase] );
+				break;
+		}
+}
+
+// Only the job thread records, and reports are printed once it has been joined
+static void log_tek_event( tek_flash_job * job, enum flash_phase_t phase, enum tek_event_code_t code
+                         , int usb_status, size_t value, size_t extra
+                         ) {
+		tek_event * event = &job->events.events[job->events.events_count++ % TEK_EVENT_LOG_SZ];
+		*event = (tek_event){ .time_ns = monotonic_time_ns(), .phase = (ui8)phase, .code = (ui8)code
+		                    , .usb_status = usb_status, .value = (uint32_t)value, .extra = (uint32_t)extra
+		                    };
+		if ( job->live_events ) {
+				char text[MAX_ERROR_STRING_SZ];
+				format_tek_event( job, event, text, sizeof text );
+				printf( "%s%s\n", job->log_prefix, text );
+		}
+}
+
+// Times are relative to the first event still in the ring
+void print_job_events( tek_flash_job const * job ) {
+		tek_event_log const * log = &job->events;
+		if ( job->live_events || !log->events_count ) {   return;   }
+
+		size_t first = 0;
+		if ( log->events_count > TEK_EVENT_LOG_SZ ) {
+				first = log->events_count - TEK_EVENT_LOG_SZ;
+				printf( "%s(%zu older events dropped)\n", job->log_prefix, first );
+		}
+		uint64_t start_ns = log->events[first % TEK_EVENT_LOG_SZ].time_ns;
+		for ( size_t i = first; i < log->events_count; ++i ) {
+				tek_event const * event = &log->events[i % TEK_EVENT_LOG_SZ];
+				char text[MAX_ERROR_STRING_SZ];
+				format_tek_event( job, event, text, sizeof text );
+				printf( "%s%10.3f ms  %s\n", job->log_prefix, (event->time_ns - start_ns) / 1e6, text );
+		}
+}
+
+//=== Library interface ===//
+
+char const * tekflash_create( tekflash_options const * options, tekflash_context * * context ) {
+		assert( options && context );
+		assert( options->hub_slots <= UPLOAD_MAX_HUB_SLOTS );
+
+		char const * opt_error = NULL;
+
+		tekflash_context * created = calloc( 1, sizeof *created );
+		if ( !created ) {
+				opt_error = "Unable to allocate a tekflash context";
+				goto function_exit;
+		}
+		created->options = *options;
+		pthread_mutex_init( &created->hubs.mutex, NULL );
+		pthread_cond_init( &created->hubs.released, NULL );
+		created->hubs.max_slots = options->hub_slots ? options->hub_slots : UPLOAD_DEFAULT_HUB_SLOTS;
+
+		if ( pipe( created->notify_fds ) < 0 ) {
+				opt_error = format_error( "Unable to create job notification pipe: %s", strerror( errno ) );
+				goto unwind_context;
+		}
+		fcntl( created->notify_fds[0], F_SETFL, O_NONBLOCK );
+		fcntl( created->notify_fds[1], F_SETFL, O_NONBLOCK );
+
+		int status = libusb_init( &created->usb_context );
+		if ( status < 0 ) {
+				opt_error = format_error( "Unable to initialize libusb: %s (%s)"
+				                        , libusb_error_name( status ), libusb_strerror( status )
+				                        );
+				goto unwind_notify_pipe;
+		}
+
+		char const * call_error = NULL;
+		if ( !options->external_events ) {
+				call_error = start_usb_event_thread( created );
+				if ( call_error ) {
+						opt_error = call_error;
+						goto unwind_usb;
+				}
+		}
+
+		call_error = start_tek_hotplug( created );
+		if ( call_error ) {
+				opt_error = call_error;
+				goto unwind_usb_event_thread;
+		}
+
+		*context = created;
+		goto function_exit;
+
+	unwind_usb_event_thread:
+		if ( !options->external_events ) {   stop_usb_event_thread( created );   }
+	unwind_usb:
+		libusb_exit( created->usb_context );
+	unwind_notify_pipe:
+		close( created->notify_fds[0] );
+		close( created->notify_fds[1] );
+	unwind_context:
+		pthread_cond_destroy( &created->hubs.released );
+		pthread_mutex_destroy( &created->hubs.mutex );
+		free( created );
+	function_exit:
+		return opt_error;
+}
+
+void tekflash_destroy( tekflash_context * context ) {
+		assert( context );
+
+		stop_tek_hotplug( context );
+		if ( !context->options.external_events ) {   stop_usb_event_thread( context );   }
+		libusb_exit( context->usb_context );
+		close( context->notify_fds[0] );
+		close( context->notify_fds[1] );
+		pthread_cond_destroy( &context->hubs.released );
+		pthread_mutex_destroy( &context->hubs.mutex );
+		free( context );
+}
+
+char const * tekflash_get_pollfds( tekflash_context * context, struct pollfd * fds, size_t * fds_sz ) {
+		assert( context && (fds || !*fds_sz) && fds_sz );
+
+		size_t count = 0;
+		if ( count < *fds_sz ) {
+				fds[count] = (struct pollfd){ .fd = context->notify_fds[0], .events = POLLIN };
+		}
+		count += 1;
+
+		if ( context->options.external_events ) {
+				struct libusb_pollfd const * * usb_fds = libusb_get_pollfds( context->usb_context );
+				if ( !usb_fds ) {   return "Unable to get usb file descriptors";   }
+				for ( struct libusb_pollfd const * * it = usb_fds; *it; ++it, ++count ) {
+						if ( count < *fds_sz ) {
+								fds[count] = (struct pollfd){ .fd = (*it)->fd, .events = (*it)->events };
+						}
+				}
+				libusb_free_pollfds( usb_fds );
+		}
+		*fds_sz = count;
+		return NULL;
+}
+
+int tekflash_get_timeout_ms( tekflash_context * context ) {
+		assert( context );
+
+		struct timeval timeout;
+		if ( !context->options.external_events || libusb_get_next_timeout( context->usb_context, &timeout ) != 1 ) {
+				return -1;
+		}
+		// Rounded up, waking up early would only find nothing to do
+		return (int)(timeout.tv_sec * 1000 + (timeout.tv_usec + 999) / 1000);
+}
+
+void tekflash_handle_events( tekflash_context * context ) {
+		assert( context );
+
+		char drained[64];
+		while ( read( context->notify_fds[0], drained, sizeof drained ) > 0 ) {}
+
+		if ( context->options.external_events ) {
+				struct timeval no_wait = { 0 };
+				libusb_handle_events_timeout_completed( context->usb_context, &no_wait, NULL );
+		}
+}
+
+char const * tekflash_find_devices( tekflash_context * context
+                                  , char port_paths[][TEKFLASH_PORT_PATH_SZ], size_t * port_paths_sz
+                                  ) {
+		assert( context && port_paths && port_paths_sz && *port_paths_sz );
+
+		usb_port_path found[TEK_MAX_DEVICES];
+		size_t found_sz = *port_paths_sz < TEK_MAX_DEVICES ? *port_paths_sz : TEK_MAX_DEVICES;
+		char const * call_error = find_tek_devices( context, true, found, &found_sz );
+		if ( call_error ) {   return call_error;   }
+		for ( size_t i = 0; i < found_sz; ++i ) {
+				format_usb_port_path( &found[i], port_paths[i] );
+		}
+		*port_paths_sz = found_sz;
+		return NULL;
+}
+
+size_t tekflash_image_size( void ) {
+		return sizeof(tekflash_image);
+}
+
+size_t tekflash_job_size( void ) {
+		return sizeof(tekflash_job);
+}
+
+char const * tekflash_load_image( tekflash_context * context, char const * filename, tekflash_image * image ) {
+		assert( context && filename && image );
+
+		return load_ihex_buffer_from_file( filename, context->options.mmap ? IHEX_LOAD_MMAP : IHEX_LOAD_READ
+		                                 , context->options.opt_cache_dir, image
+		                                 );
+}
+
+char const * tekflash_parse_image( char const * ihex_text, size_t ihex_text_sz, tekflash_image * image ) {
+		assert( (ihex_text || !ihex_text_sz) && image );
+
+		return load_ihex_buffer( ihex_text, ihex_text_sz, image );
+}
+
+static void * run_tekflash_job( void * tekflash_job_ ) {
+		tekflash_job * job = tekflash_job_;
+		flash_tek_device( &job->job );
+		atomic_store( &job->done, true );
+		// The write end is non-blocking, a full pipe already guarantees a wake up
+		ssize_t written = write( job->job.context->notify_fds[1], "", 1 );
+		(void)written;
+		return NULL;
+}
+
+static char const * start_tekflash_job( tekflash_context * context, tekflash_job * job ) {
+		job->job.context = context;
+		job->reaped  = false;
+		job->job.opt_cancel = &job->cancel;
+		atomic_init( &job->cancel, false );
+		atomic_init( &job->done, false );
+
+		job->job.thread_started = pthread_create( &job->job.thread, NULL, run_tekflash_job, job ) == 0;
+		if ( !job->job.thread_started ) {
+				job->job.error = "Unable to start flashing thread";
+				atomic_store( &job->done, true );
+				return job->job.error;
+		}
+		return NULL;
+}
+
+char const * tekflash_submit( tekflash_context * context, char const * port_path
+                            , tekflash_image const * image, tekflash_job_options const * options
+                            , tekflash_job * job
+                            ) {
+		assert( context && port_path && image && options && job );
+
+		job->job = (tek_flash_job){ .context = context
+		                          , .image  = image
+		                          , .delta  = options->delta
+		                          , .verify = options->verify
+		                          , .queue_depth = options->queue_depth ? options->queue_depth : UPLOAD_DEFAULT_QUEUE_DEPTH
+		                          , .reconnect_timeout_ms = options->reconnect_timeout_ms ? options->reconnect_timeout_ms
+		                                                                                  : TEK_DEFAULT_RECONNECT_TIMEOUT_MS
+		                          , .opt_journal_dir = options->opt_journal_dir
+		                          };
+		if ( !parse_usb_port_path( port_path, &job->job.port_path ) ) {
+				return format_error( "Invalid port path \"%s\"", port_path );
+		}
+		if ( job->job.queue_depth > UPLOAD_MAX_QUEUE_DEPTH ) {
+				return format_error( "Queue depth above %d", UPLOAD_MAX_QUEUE_DEPTH );
+		}
+		snprintf( job->job.log_prefix, sizeof job->job.log_prefix, "[%s] ", port_path );
+		return start_tekflash_job( context, job );
+}
+
+static enum tekflash_job_state_t reap_tekflash_job( tekflash_job * job, tekflash_job_result * opt_result ) {
+		if ( !job->reaped ) {
+				if ( job->job.thread_started ) {   pthread_join( job->job.thread, NULL );   }
+				job->reaped = true;
+		}
+		if ( opt_result ) {
+				upload_stats const * stats = &job->job.upload_stats;
+				*opt_result = (tekflash_job_result){ .bytes_sent      = stats->bytes_sent
+				                                   , .transfers_count = stats->transfers_count
+				                                   , .pages_skipped   = stats->pages_skipped
+				                                   , .pages_resumed   = stats->pages_resumed
+				                                   , .pages_verified  = stats->pages_verified
+				                                   , .error           = job->job.error
+				                                   };
+		}
+		return job->job.error ? TEKFLASH_JOB_FAILED : TEKFLASH_JOB_SUCCEEDED;
+}
+
+enum tekflash_job_state_t tekflash_poll( tekflash_job * job, tekflash_job_result * opt_result ) {
+		assert( job );
+
+		if ( !atomic_load( &job->done ) ) {   return TEKFLASH_JOB_RUNNING;   }
+		return reap_tekflash_job( job, opt_result );
+}
+
+enum tekflash_job_state_t tekflash_wait( tekflash_job * job, tekflash_job_result * opt_result ) {
+		assert( job );
+
+		return reap_tekflash_job( job, opt_result );
+}
+
+void tekflash_cancel( tekflash_job * job ) {
+		assert( job );
+
+		atomic_store( &job->cancel, true );
+}
+
+//=== Flashing daemon ===//
+
+// Images are picked by the bcdDevice of the arriving keyboard, the image loaded
+// for DAEMON_ANY_BCD_DEVICE goes to keyboards without an image of their own
+#define DAEMON_ANY_BCD_DEVICE  -1
+#define DAEMON_MAX_IMAGES      16
+#define DAEMON_MAX_CLIENTS     8
+#define DAEMON_MAX_EVENTS      64
+#define DAEMON_COMMAND_SZ      512
+#define DAEMON_FILENAME_SZ     256
+
+typedef struct {
+		ihex_image * image; // NULL when the slot is free
+		long         bcd_device;
+		char         filename[DAEMON_FILENAME_SZ];
+		size_t       jobs_count; // running jobs reading the image, it cannot be unloaded meanwhile
+} daemon_image;
+
+// Prometheus text exposition served on a local port, one GET per connection
+// The daemon loop adds the results of a job to the counters of its device slot when
+// reaping it, a scrape sums every slot
+#define DAEMON_MAX_METRICS_CLIENTS 4
+#define DAEMON_METRICS_REQUEST_SZ  2048
+#define DAEMON_METRICS_BUCKETS     12
+// LIBUSB_ERROR_IO to LIBUSB_ERROR_NOT_SUPPORTED, then any other error, then no usb error
+#define DAEMON_METRICS_USB_ERRORS  14
+
+static uint64_t const daemon_metrics_bucket_bounds_ns[DAEMON_METRICS_BUCKETS] = {
+		1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000, 250000000
+	, 500000000, 1000000000, 2500000000u, 5000000000u
+};
+
+// No separate count, a scrape would read it apart from the buckets it must match
+typedef struct {
+		atomic_uint_fast64_t sum_ns;
+		atomic_uint_fast64_t buckets[DAEMON_METRICS_BUCKETS + 1]; // the last one is above every bound
+} daemon_histogram;
+
+enum daemon_counter_t {
+		DAEMON_COUNTER_DEVICES_FLASHED,
+		DAEMON_COUNTER_BYTES_SENT,
+		DAEMON_COUNTER_TRANSFERS,
+		DAEMON_COUNTER_PAGES_SKIPPED,
+		DAEMON_COUNTER_PAGES_RESUMED,
+		DAEMON_COUNTER_TRANSFERS_FAILED,
+		DAEMON_COUNTER_TRANSFERS_RETRIED,
+		DAEMON_COUNTER_PAGES_RETRIED,
+		DAEMON_COUNTERS_COUNT
+};
+
+typedef struct {
+		atomic_uint_fast64_t counters[DAEMON_COUNTERS_COUNT];
+		atomic_uint_fast64_t devices_failed[DAEMON_METRICS_USB_ERRORS];
+		daemon_histogram     phases[FLASH_PHASES_COUNT];
+} daemon_metrics;
+
+// Sum of every slot at the time of a scrape
+typedef struct {
+		uint64_t counters[DAEMON_COUNTERS_COUNT];
+		uint64_t devices_failed[DAEMON_METRICS_USB_ERRORS];
+		uint64_t phase_sums_ns[FLASH_PHASES_COUNT];
+		uint64_t phase_buckets[FLASH_PHASES_COUNT][DAEMON_METRICS_BUCKETS + 1];
+} daemon_metrics_totals;
+
+typedef struct {
+		int    fd;
+		size_t request_sz;
+		char   request[DAEMON_METRICS_REQUEST_SZ];
+} daemon_metrics_client;
+
+// A keyboard stays DONE until unplugged, so that it is not flashed again when it
+// comes back in normal state after its own upload
+enum daemon_device_state_t {
+		DAEMON_DEVICE_FREE,
+		DAEMON_DEVICE_FLASHING,
+		DAEMON_DEVICE_DONE
+};
+
+typedef struct {
+		enum daemon_device_state_t state;
+		size_t                     image_index;
+		tekflash_job               job;     // polled by the daemon loop when the context signals a job end
+		daemon_metrics             metrics; // kept across jobs
+} daemon_device;
+
+typedef struct {
+		usb_port_path           port_path;
+		enum tek_device_state_t state;
+		ui16                    bcd_device;
+		bool                    arrived;
+} daemon_hotplug_event;
+
+typedef struct {
+		int    fd;
+		size_t command_sz;
+		char   command[DAEMON_COMMAND_SZ];
+} daemon_client;
+
+// Everything but the hotplug event queue is only touched by the daemon loop, the event
+// thread just queues and wakes it up, job ends wake it up through the context
+static struct {
+		pthread_mutex_t      mutex;
+		size_t               events_count;
+		daemon_hotplug_event events[DAEMON_MAX_EVENTS];
+		bool                 events_overflowed; // events were dropped, the hotplug table is rescanned
+		int                  wake_fds[2];
+
+		tekflash_context *    context;
+		tek_flash_job const * job_template;
+		enum stats_format_t   stats_format;
+		bool                  stop;
+
+		daemon_image  images[DAEMON_MAX_IMAGES];
+		daemon_device devices[TEK_MAX_DEVICES];
+		size_t        clients_count;
+		daemon_client clients[DAEMON_MAX_CLIENTS];
+
+		daemon_metrics        metrics; // image loads, added to by the daemon loop
+		int                   metrics_fd;
+		size_t                metrics_clients_count;
+		daemon_metrics_client metrics_clients[DAEMON_MAX_METRICS_CLIENTS];
+} tek_daemon = { .mutex = PTHREAD_MUTEX_INITIALIZER, .wake_fds = { -1, -1 }, .metrics_fd = -1 };
+
+static volatile sig_atomic_t tek_daemon_signaled;
+
+// The write end is non-blocking, a full pipe already guarantees a wake up
+static void wake_tek_daemon( void ) {
+		int saved_errno = errno;
+		ssize_t written = write( tek_daemon.wake_fds[1], "", 1 );
+		(void)written;
+		errno = saved_errno;
+}
+
+static void handle_tek_daemon_signal( int signal_number ) {
+		(void)signal_number;
+		tek_daemon_signaled = 1;
+		wake_tek_daemon();
+}
+
+static void queue_tek_daemon_event( usb_port_path const * port_path, enum tek_device_state_t tek_device_state
+                                  , ui16 bcd_device, bool arrived, void * unused
+                                  ) {
+		(void)unused;
+		pthread_mutex_lock( &tek_daemon.mutex );
+		if ( tek_daemon.events_count < DAEMON_MAX_EVENTS ) {
+				tek_daemon.events[tek_daemon.events_count++] = (daemon_hotplug_event){ *port_path, tek_device_state
+				                                                                     , bcd_device, arrived
+				                                                                     };
+		} else {
+				tek_daemon.events_overflowed = true;
+		}
+		pthread_mutex_unlock( &tek_daemon.mutex );
+		wake_tek_daemon();
+}
+
+static void add_daemon_metric( atomic_uint_fast64_t * counter, uint64_t value ) {
+		atomic_fetch_add_explicit( counter, value, memory_order_relaxed );
+}
+
+static void observe_daemon_phase( daemon_histogram * histogram, uint64_t duration_ns ) {
+		size_t bucket = 0;
+		while ( bucket < DAEMON_METRICS_BUCKETS && duration_ns > daemon_metrics_bucket_bounds_ns[bucket] ) {   bucket += 1;   }
+		add_daemon_metric( &histogram->buckets[bucket], 1 );
+		add_daemon_metric( &histogram->sum_ns, duration_ns );
+}
+
+static size_t daemon_metrics_error_index( int usb_status ) {
+		if ( usb_status == LIBUSB_SUCCESS ) {   return DAEMON_METRICS_USB_ERRORS - 1;   }
+		if ( usb_status < 0 && usb_status >= LIBUSB_ERROR_NOT_SUPPORTED ) {   return (size_t)(-usb_status - 1);   }
+		return DAEMON_METRICS_USB_ERRORS - 2;
+}
+
+// Phases a job did not go through are not observed
+static void record_daemon_job_metrics( daemon_metrics * metrics, tek_flash_job const * job ) {
+		upload_stats const * stats = &job->upload_stats;
+		atomic_uint_fast64_t * counters = metrics->counters;
+		if ( job->error ) {
+				add_daemon_metric( &metrics->devices_failed[daemon_metrics_error_index( stats->failed_usb_status )], 1 );
+		} else {
+				add_daemon_metric( &counters[DAEMON_COUNTER_DEVICES_FLASHED], 1 );
+		}
+		add_daemon_metric( &counters[DAEMON_COUNTER_BYTES_SENT],        stats->bytes_sent );
+		add_daemon_metric( &counters[DAEMON_COUNTER_TRANSFERS],         stats->transfers_count );
+		add_daemon_metric( &counters[DAEMON_COUNTER_PAGES_SKIPPED],     stats->pages_skipped );
+		add_daemon_metric( &counters[DAEMON_COUNTER_PAGES_RESUMED],     stats->pages_resumed );
+		add_daemon_metric( &counters[DAEMON_COUNTER_TRANSFERS_FAILED],  stats->transfers_failed );
+		add_daemon_metric( &counters[DAEMON_COUNTER_TRANSFERS_RETRIED], stats->transfers_retried );
+		add_daemon_metric( &counters[DAEMON_COUNTER_PAGES_RETRIED],     stats->pages_retried );
+		for ( size_t phase = 0; phase < FLASH_PHASES_COUNT; ++phase ) {
+				if ( job->phase_ns[phase] ) {   observe_daemon_phase( &metrics->phases[phase], job->phase_ns[phase] );   }
+		}
+}
+
+static daemon_device * find_daemon_device( usb_port_path const * port_path ) {
+		for ( size_t i = 0; i < TEK_MAX_DEVICES; ++i ) {
+				daemon_device * device = &tek_daemon.devices[i];
+				if ( device->state != DAEMON_DEVICE_FREE && usb_port_path_equal( &device->job.job.port_path, port_path ) ) {
+						return device;
+				}
+		}
+		return NULL;
+}
+
+static daemon_image * find_daemon_image( long bcd_device ) {
+		for ( size_t i = 0; i < DAEMON_MAX_IMAGES; ++i ) {
+				if ( tek_daemon.images[i].image && tek_daemon.images[i].bcd_device == bcd_device ) {
+						return &tek_daemon.images[i];
+				}
+		}
+		return NULL;
+}
+
+static void start_daemon_job( daemon_hotplug_event const * event ) {
+		daemon_device * device = NULL;
+		for ( size_t i = 0; i < TEK_MAX_DEVICES && !device; ++i ) {
+				if ( tek_daemon.devices[i].state == DAEMON_DEVICE_FREE ) {   device = &tek_daemon.devices[i];   }
+		}
+		if ( !device ) {   return;   } // cannot happen, there are as many slots as addresses on a bus
+
+		device->job.job = *tek_daemon.job_template;
+		device->job.job.port_path = event->port_path;
+		char port_path_string[USB_PORT_PATH_STRING_SZ];
+		snprintf( device->job.job.log_prefix, sizeof device->job.job.log_prefix, "[%s] "
+		        , format_usb_port_path( &event->port_path, port_path_string )
+		        );
+		device->state = DAEMON_DEVICE_DONE;
+
+		daemon_image * image = find_daemon_image( event->bcd_device );
+		if ( !image ) {   image = find_daemon_image( DAEMON_ANY_BCD_DEVICE );   }
+		if ( !image ) {
+				snprintf( device->job.job.error_buffer, MAX_ERROR_STRING_SZ, "No image loaded for bcdDevice 0x%04x"
+				        , event->bcd_device
+				        );
+				device->job.job.error = device->job.job.error_buffer;
+				printf( "%s%s, skipped until unplugged.\n", device->job.job.log_prefix, device->job.job.error );
+				return;
+		}
+
+		device->image_index = (size_t)(image - tek_daemon.images);
+		device->job.job.image = image->image;
+		char const * call_error = start_tekflash_job( tek_daemon.context, &device->job );
+		if ( call_error ) {
+				fprintf( stderr, "%sError: %s\n", device->job.job.log_prefix, call_error );
+				return;
+		}
+		image->jobs_count += 1;
+		device->state = DAEMON_DEVICE_FLASHING;
+		printf( "%sTEK plugged in, flashing %s.\n", device->job.job.log_prefix, image->filename );
+}
+
+// Once events were dropped, keyboards attached in normal state without a device slot
+// get a job and done slots whose keyboard is gone are freed, as if nothing was lost
+static void rescan_daemon_devices( void ) {
+		for ( size_t i = 0; i < TEK_MAX_DEVICES; ++i ) {
+				daemon_device * device = &tek_daemon.devices[i];
+				if ( device->state != DAEMON_DEVICE_DONE ) {   continue;   }
+				tek_attached_device attached;
+				if ( ref_attached_tek_device( tek_daemon.context, &device->job.job.port_path, &attached ) ) {
+						libusb_unref_device( attached.device );
+						continue;
+				}
+				device->state = DAEMON_DEVICE_FREE;
+		}
+
+		usb_port_path port_paths[TEK_MAX_DEVICES];
+		size_t attached_count;
+		if ( !get_attached_tek_port_paths( tek_daemon.context, port_paths, TEK_MAX_DEVICES, &attached_count ) ) {   return;   }
+		for ( size_t i = 0; i < attached_count && i < TEK_MAX_DEVICES; ++i ) {
+				tek_attached_device attached;
+				if ( !ref_attached_tek_device( tek_daemon.context, &port_paths[i], &attached ) ) {   continue;   }
+				if ( is_tek_in_state( &attached, TEK_NORMAL_STATE ) && !find_daemon_device( &port_paths[i] ) ) {
+						start_daemon_job( &(daemon_hotplug_event){ port_paths[i], TEK_NORMAL_STATE, attached.bcd_device, true } );
+				}
+				libusb_unref_device( attached.device );
+		}
+}
+
+static void process_daemon_events( void ) {
+		daemon_hotplug_event events[DAEMON_MAX_EVENTS];
+		pthread_mutex_lock( &tek_daemon.mutex );
+		size_t events_count = tek_daemon.events_count;
+		memcpy( events, tek_daemon.events, events_count * sizeof *events );
+		tek_daemon.events_count = 0;
+		bool events_overflowed = tek_daemon.events_overflowed;
+		tek_daemon.events_overflowed = false;
+		pthread_mutex_unlock( &tek_daemon.mutex );
+
+		// Arrivals and departures in programmable state belong to a running job, and
+		// so do the ones of its switches while it is flashing; a departure heard late
+		// after the reboot back to normal mode finds the flashed keyboard still there
+		for ( size_t i = 0; i < events_count; ++i ) {
+				daemon_hotplug_event const * event = &events[i];
+				if ( event->state != TEK_NORMAL_STATE ) {   continue;   }
+				daemon_device * device = find_daemon_device( &event->port_path );
+				if ( event->arrived && !device ) {
+						start_daemon_job( event );
+				} else if ( !event->arrived && device && device->state == DAEMON_DEVICE_DONE ) {
+						tek_attached_device attached;
+						if ( ref_attached_tek_device( tek_daemon.context, &event->port_path, &attached ) ) {
+								libusb_unref_device( attached.device );
+								continue;
+						}
+						device->state = DAEMON_DEVICE_FREE;
+				}
+		}
+		if ( events_overflowed ) {   rescan_daemon_devices();   }
+
+		for ( size_t i = 0; i < TEK_MAX_DEVICES; ++i ) {
+				daemon_device * device = &tek_daemon.devices[i];
+				if ( device->state != DAEMON_DEVICE_FLASHING ) {   continue;   }
+				if ( tekflash_poll( &device->job, NULL ) == TEKFLASH_JOB_RUNNING ) {   continue;   }
+				record_daemon_job_metrics( &device->metrics, &device->job.job );
+				tek_daemon.images[device->image_index].jobs_count -= 1;
+				device->state = DAEMON_DEVICE_DONE;
+				print_job_events( &device->job.job );
+				if ( device->job.job.error ) {
+						fprintf( stderr, "%sError: %s\n", device->job.job.log_prefix, device->job.job.error );
+				} else {
+						printf( "%sFirmware successfully flashed.\n", device->job.job.log_prefix );
+				}
+				print_flash_stats( &device->job.job, tek_daemon.stats_format );
+		}
+		fflush( stdout );
+}
+
+static char const * load_daemon_image( long bcd_device, char const * filename ) {
+		if ( strlen( filename ) >= DAEMON_FILENAME_SZ ) {   return "Image file name too long";   }
+
+		daemon_image * slot = find_daemon_image( bcd_device );
+		if ( slot && slot->jobs_count ) {   return "Image is in use by running jobs";   }
+		for ( size_t i = 0; i < DAEMON_MAX_IMAGES && !slot; ++i ) {
+				if ( !tek_daemon.images[i].image ) {   slot = &tek_daemon.images[i];   }
+		}
+		if ( !slot ) {   return "Too many images loaded";   }
+
+		ihex_image * image = malloc( sizeof *image );
+		if ( !image ) {   return "Out of memory";   }
+		uint64_t load_start_ns = monotonic_time_ns();
+		char const * call_error = tekflash_load_image( tek_daemon.context, filename, image );
+		observe_daemon_phase( &tek_daemon.metrics.phases[FLASH_PHASE_LOAD], monotonic_time_ns() - load_start_ns );
+		if ( call_error ) {
+				free( image );
+				return call_error;
+		}
+
+		free( slot->image );
+		*slot = (daemon_image){ .image = image, .bcd_device = bcd_device };
+		snprintf( slot->filename, sizeof slot->filename, "%s", filename );
+		return NULL;
+}
+
+// "any" or a hexadecimal bcdDevice, with or without 0x prefix
+static bool parse_bcd_device_argument( char const * argument, long * bcd_device ) {
+		if ( !argument ) {   return false;   }
+		if ( strcmp( argument, "any" ) == 0 ) {
+				*bcd_device = DAEMON_ANY_BCD_DEVICE;
+				return true;
+		}
+		char * argument_end;
+		errno = 0;
+		unsigned long parsed = strtoul( argument, &argument_end, 16 );
+		if ( errno || argument_end == argument || *argument_end || parsed > 0xFFFF ) {   return false;   }
+		*bcd_device = (long)parsed;
+		return true;
+}
+
+static void format_bcd_device( long bcd_device, char bcd_device_string[7] ) {
+		if ( bcd_device == DAEMON_ANY_BCD_DEVICE ) {
+				snprintf( bcd_device_string, 7, "any" );
+		} else {
+				snprintf( bcd_device_string, 7, "0x%04x", (unsigned)(bcd_device & 0xFFFF) );
+		}
+}
+
+static void reply_to_daemon_client( daemon_client const * client, char const * format, ... ) {
+		char reply[DAEMON_COMMAND_SZ + MAX_ERROR_STRING_SZ];
+		va_list args;
+		va_start( args, format );
+		int reply_sz = vsnprintf( reply, sizeof reply - 1, format, args );
+		va_end( args );
+		if ( reply_sz < 0 ) {   return;   }
+		if ( (size_t)reply_sz > sizeof reply - 2 ) {   reply_sz = sizeof reply - 2;   }
+		reply[reply_sz++] = '\n';
+		// A client not reading its replies only loses them, the daemon never blocks on it
+		ssize_t sent = send( client->fd, reply, (size_t)reply_sz, MSG_NOSIGNAL | MSG_DONTWAIT );
+		(void)sent;
+}
+
+// One command per line, every command is answered by "ok" or "error <reason>",
+// status first lists one "image" line per image and one "device" line per keyboard
+static void run_daemon_command( daemon_client const * client, char * command ) {
+		char * saveptr;
+		char const * verb = strtok_r( command, " \t\r", &saveptr );
+		if ( !verb ) {   return;   }
+
+		if ( strcmp( verb, "load" ) == 0 ) {
+				long bcd_device;
+				char * filename = NULL;
+				if ( parse_bcd_device_argument( strtok_r( NULL, " \t\r", &saveptr ), &bcd_device ) ) {
+						filename = strtok_r( NULL, "\r", &saveptr );
+				}
+				while ( filename && (*filename == ' ' || *filename == '\t') ) {   filename += 1;   }
+				if ( !filename || !*filename ) {
+						reply_to_daemon_client( client, "error Usage: load <bcdDevice|any> <firmware file>" );
+						return;
+				}
+				char const * call_error = load_daemon_image( bcd_device, filename );
+				if ( call_error ) {
+						reply_to_daemon_client( client, "error %s", call_error );
+						return;
+				}
+		} else if ( strcmp( verb, "unload" ) == 0 ) {
+				long bcd_device;
+				if ( !parse_bcd_device_argument( strtok_r( NULL, " \t\r", &saveptr ), &bcd_device ) ) {
+						reply_to_daemon_client( client, "error Usage: unload <bcdDevice|any>" );
+						return;
+				}
+				daemon_image * image = find_daemon_image( bcd_device );
+				if ( !image ) {
+						reply_to_daemon_client( client, "error No image loaded for this bcdDevice" );
+						return;
+				}
+				if ( image->jobs_count ) {
+						reply_to_daemon_client( client, "error Image is in use by running jobs" );
+						return;
+				}
+				free( image->image );
+				image->image = NULL;
+		} else if ( strcmp( verb, "status" ) == 0 ) {
+				for ( size_t i = 0; i < DAEMON_MAX_IMAGES; ++i ) {
+						daemon_image const * image = &tek_daemon.images[i];
+						if ( !image->image ) {   continue;   }
+						char bcd_device_string[7];
+						format_bcd_device( image->bcd_device, bcd_device_string );
+						reply_to_daemon_client( client, "image %s %zu bytes %zu jobs %s"
+						                      , bcd_device_string, image->image->highest_addr, image->jobs_count
+						                      , image->filename
+						                      );
+				}
+				for ( size_t i = 0; i < TEK_MAX_DEVICES; ++i ) {
+						daemon_device const * device = &tek_daemon.devices[i];
+						if ( device->state == DAEMON_DEVICE_FREE ) {   continue;   }
+						char port_path_string[USB_PORT_PATH_STRING_SZ];
+						format_usb_port_path( &device->job.job.port_path, port_path_string );
+						if ( device->state == DAEMON_DEVICE_FLASHING ) {
+								reply_to_daemon_client( client, "device %s flashing", port_path_string );
+						} else if ( device->job.job.error ) {
+								reply_to_daemon_client( client, "device %s error %s", port_path_string, device->job.job.error );
+						} else {
+								reply_to_daemon_client( client, "device %s ok", port_path_string );
+						}
+				}
+		} else if ( strcmp( verb, "quit" ) == 0 ) {
+				tek_daemon.stop = true;
+		} else {
+				reply_to_daemon_client( client, "error Unknown command \"%s\"", verb );
+				return;
+		}
+		reply_to_daemon_client( client, "ok" );
+}
+
+// Returns false once the client is gone
+static bool read_daemon_client( daemon_client * client ) {
+		ssize_t read_sz = recv( client->fd, client->command + client->command_sz
+		                      , sizeof client->command - client->command_sz, 0
+		                      );
+		if ( read_sz < 0 && errno == EINTR ) {   return true;   }
+		if ( read_sz <= 0 ) {   return false;   }
+		client->command_sz += (size_t)read_sz;
+
+		char * line = client->command;
+		char * command_end = client->command + client->command_sz;
+		char * line_end;
+		while ( (line_end = memchr( line, '\n', (size_t)(command_end - line) )) ) {
+				*line_end = '\0';
+				run_daemon_command( client, line );
+				line = line_end + 1;
+		}
+		client->command_sz = (size_t)(command_end - line);
+		if ( client->command_sz == sizeof client->command ) {
+				reply_to_daemon_client( client, "error Command too long" );
+				return false;
+		}
+		memmove( client->command, line, client->command_sz );
+		return true;
+}
+
+static char const * open_daemon_socket( char const * socket_path, int * socket_fd ) {
+		struct sockaddr_un address = { .sun_family = AF_UNIX };
+		if ( strlen( socket_path ) >= sizeof address.sun_path ) {
+				return format_error( "Control socket path \"%s\" is too long", socket_path );
+		}
+		strcpy( address.sun_path, socket_path );
+
+		*socket_fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+		if ( *socket_fd < 0 ) {
+				return format_error( "Unable to create control socket: %s", strerror( errno ) );
+		}
+		if ( bind( *socket_fd, (struct sockaddr const *)&address, sizeof address ) < 0
+		  || listen( *socket_fd, DAEMON_MAX_CLIENTS ) < 0
+		   ) {
+				char const * error = format_error( "Unable to listen on control socket \"%s\": %s", socket_path, strerror( errno ) );
+				close( *socket_fd );
+				return error;
+		}
+		return NULL;
+}
+
+static struct {
+		char const * name;
+		char const * help;
+} const daemon_counters[DAEMON_COUNTERS_COUNT] = {
+		[DAEMON_COUNTER_DEVICES_FLASHED]   = { "tekflash_devices_flashed_total",   "Keyboards flashed successfully" },
+		[DAEMON_COUNTER_BYTES_SENT]        = { "tekflash_upload_bytes_total",      "Firmware bytes written to keyboards" },
+		[DAEMON_COUNTER_TRANSFERS]         = { "tekflash_upload_transfers_total",  "Upload transfers completed, failed ones included" },
+		[DAEMON_COUNTER_PAGES_SKIPPED]     = { "tekflash_pages_skipped_total",     "Pages left alone by delta uploads" },
+		[DAEMON_COUNTER_PAGES_RESUMED]     = { "tekflash_pages_resumed_total",     "Pages found committed in a progress journal" },
+		[DAEMON_COUNTER_TRANSFERS_FAILED]  = { "tekflash_transfers_failed_total",  "Upload transfers that failed" },
+		[DAEMON_COUNTER_TRANSFERS_RETRIED] = { "tekflash_transfers_retried_total", "Upload transfers sent again to retry a page" },
+		[DAEMON_COUNTER_PAGES_RETRIED]     = { "tekflash_pages_retried_total",     "Pages programmed again after a failed transfer" },
+};
+
+static void add_daemon_metrics_totals( daemon_metrics * metrics, daemon_metrics_totals * totals ) {
+		for ( size_t i = 0; i < DAEMON_COUNTERS_COUNT; ++i ) {
+				totals->counters[i] += atomic_load_explicit( &metrics->counters[i], memory_order_relaxed );
+		}
+		for ( size_t i = 0; i < DAEMON_METRICS_USB_ERRORS; ++i ) {
+				totals->devices_failed[i] += atomic_load_explicit( &metrics->devices_failed[i], memory_order_relaxed );
+		}
+		for ( size_t phase = 0; phase < FLASH_PHASES_COUNT; ++phase ) {
+				daemon_histogram * histogram = &metrics->phases[phase];
+				totals->phase_sums_ns[phase] += atomic_load_explicit( &histogram->sum_ns, memory_order_relaxed );
+				for ( size_t bucket = 0; bucket <= DAEMON_METRICS_BUCKETS; ++bucket ) {
+						totals->phase_buckets[phase][bucket] += atomic_load_explicit( &histogram->buckets[bucket], memory_order_relaxed );
+				}
+		}
+}
+
+static char const * daemon_metrics_error_name( size_t error_index ) {
+		if ( error_index == DAEMON_METRICS_USB_ERRORS - 1 ) {   return "none";   }
+		if ( error_index == DAEMON_METRICS_USB_ERRORS - 2 ) {   return libusb_error_name( LIBUSB_ERROR_OTHER );   }
+		return libusb_error_name( -(int)error_index - 1 );
+}
+
+static void write_daemon_metrics( FILE * output ) {
+		static daemon_metrics_totals totals;
+		totals = (daemon_metrics_totals){ 0 };
+		add_daemon_metrics_totals( &tek_daemon.metrics, &totals );
+		for ( size_t i = 0; i < TEK_MAX_DEVICES; ++i ) {
+				add_daemon_metrics_totals( &tek_daemon.devices[i].metrics, &totals );
+		}
+
+		for ( size_t i = 0; i < DAEMON_COUNTERS_COUNT; ++i ) {
+				fprintf( output, "# HELP %s %s.\n# TYPE %s counter\n%s %" PRIu64 "\n"
+				       , daemon_counters[i].name, daemon_counters[i].help, daemon_counters[i].name
+				       , daemon_counters[i].name, totals.counters[i]
+				       );
+		}
+		fprintf( output, "# HELP tekflash_devices_failed_total Keyboards that failed to flash, by libusb error of"
+		                 " the failed transfer.\n# TYPE tekflash_devices_failed_total counter\n"
+		       );
+		for ( size_t i = 0; i < DAEMON_METRICS_USB_ERRORS; ++i ) {
+				fprintf( output, "tekflash_devices_failed_total{error=\"%s\"} %" PRIu64 "\n"
+				       , daemon_metrics_error_name( i ), totals.devices_failed[i]
+				       );
+		}
+		fprintf( output, "# HELP tekflash_phase_duration_seconds Time spent in each phase of a job, image loads"
+		                 " for load.\n# TYPE tekflash_phase_duration_seconds histogram\n"
+		       );
+		for ( size_t phase = 0; phase < FLASH_PHASES_COUNT; ++phase ) {
+				uint64_t cumulative = 0;
+				for ( size_t bucket = 0; bucket < DAEMON_METRICS_BUCKETS; ++bucket ) {
+						cumulative += totals.phase_buckets[phase][bucket];
+						fprintf( output, "tekflash_phase_duration_seconds_bucket{phase=\"%s\",le=\"%g\"} %" PRIu64 "\n"
+						       , flash_phase_names[phase], daemon_metrics_bucket_bounds_ns[bucket] / 1e9, cumulative
+						       );
+				}
+				cumulative += totals.phase_buckets[phase][DAEMON_METRICS_BUCKETS];
+				fprintf( output, "tekflash_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %" PRIu64 "\n"
+				                 "tekflash_phase_duration_seconds_sum{phase=\"%s\"} %.9f\n"
+				                 "tekflash_phase_duration_seconds_count{phase=\"%s\"} %" PRIu64 "\n"
+				       , flash_phase_names[phase], cumulative
+				       , flash_phase_names[phase], totals.phase_sums_ns[phase] / 1e9
+				       , flash_phase_names[phase], cumulative
+				       );
+		}
+}
+
+// Like control clients, a scraper not reading its reply only loses it
+static void reply_to_metrics_client( daemon_metrics_client const * client ) {
+		bool found = strncmp( client->request, "GET /metrics ", 13 ) == 0 || strncmp( client->request, "GET / ", 6 ) == 0;
+		char * body = NULL;
+		size_t body_sz = 0;
+		FILE * output = open_memstream( &body, &body_sz );
+		if ( !output ) {   return;   }
+		if ( found ) {
+				write_daemon_metrics( output );
+		} else {
+				fprintf( output, "Metrics are served at /metrics\n" );
+		}
+		fclose( output );
+
+		char header[192];
+		int header_sz = snprintf( header, sizeof header, "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+		                                                 "Content-Length: %zu\r\nConnection: close\r\n\r\n"
+		                        , found ? "200 OK" : "404 Not Found", body_sz
+		                        );
+		ssize_t sent = send( client->fd, header, (size_t)header_sz, MSG_NOSIGNAL | MSG_DONTWAIT );
+		if ( sent == header_sz ) {   sent = send( client->fd, body, body_sz, MSG_NOSIGNAL | MSG_DONTWAIT );   }
+		(void)sent;
+		free( body );
+}
+
+// Returns false once the client got its reply or is gone
+static bool read_metrics_client( daemon_metrics_client * client ) {
+		ssize_t read_sz = recv( client->fd, client->request + client->request_sz
+		                      , sizeof client->request - 1 - client->request_sz, 0
+		                      );
+		if ( read_sz < 0 && errno == EINTR ) {   return true;   }
+		if ( read_sz <= 0 ) {   return false;   }
+		client->request_sz += (size_t)read_sz;
+		client->request[client->request_sz] = '\0';
+
+		// The reply waits for the end of the headers, closing on unread ones would reset it
+		if ( !strstr( client->request, "\r\n\r\n" ) && !strstr( client->request, "\n\n" ) ) {
+				return client->request_sz < sizeof client->request - 1;
+		}
+		reply_to_metrics_client( client );
+		return false;
+}
+
+static char const * open_metrics_socket( size_t port, int * socket_fd ) {
+		struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons( (uint16_t)port )
+		                             , .sin_addr = { htonl( INADDR_LOOPBACK ) }
+		                             };
+		*socket_fd = socket( AF_INET, SOCK_STREAM, 0 );
+		if ( *socket_fd < 0 ) {
+				return format_error( "Unable to create metrics socket: %s", strerror( errno ) );
+		}
+		int reuse = 1;
+		setsockopt( *socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse );
+		if ( bind( *socket_fd, (struct sockaddr const *)&address, sizeof address ) < 0
+		  || listen( *socket_fd, DAEMON_MAX_METRICS_CLIENTS ) < 0
+		   ) {
+				char const * error = format_error( "Unable to listen for metrics on port %zu: %s", port, strerror( errno ) );
+				close( *socket_fd );
+				return error;
+		}
+		return NULL;
+}
+
+static void run_daemon_loop( int socket_fd, int job_fd ) {
+		while ( !tek_daemon.stop && !tek_daemon_signaled ) {
+				// Without metrics their descriptor is -1, which poll skips
+				struct pollfd poll_fds[4 + DAEMON_MAX_CLIENTS + DAEMON_MAX_METRICS_CLIENTS] =
+						{ { .fd = tek_daemon.wake_fds[0], .events = POLLIN }
+						, { .fd = socket_fd,              .events = POLLIN }
+						, { .fd = tek_daemon.metrics_fd,  .events = POLLIN }
+						, { .fd = job_fd,                 .events = POLLIN }
+						};
+				struct pollfd * client_poll_fds  = poll_fds + 4;
+				struct pollfd * metrics_poll_fds = client_poll_fds + tek_daemon.clients_count;
+				for ( size_t i = 0; i < tek_daemon.clients_count; ++i ) {
+						client_poll_fds[i] = (struct pollfd){ .fd = tek_daemon.clients[i].fd, .events = POLLIN };
+				}
+				for ( size_t i = 0; i < tek_daemon.metrics_clients_count; ++i ) {
+						metrics_poll_fds[i] = (struct pollfd){ .fd = tek_daemon.metrics_clients[i].fd, .events = POLLIN };
+				}
+				nfds_t poll_fds_count = (nfds_t)(4 + tek_daemon.clients_count + tek_daemon.metrics_clients_count);
+				if ( poll( poll_fds, poll_fds_count, -1 ) < 0 ) {
+						if ( errno == EINTR ) {   continue;   }
+						fprintf( stderr, "Error: Unable to wait on the control socket: %s\n", strerror( errno ) );
+						return;
+				}
+
+				if ( poll_fds[0].revents || poll_fds[3].revents ) {
+						char drained[64];
+						while ( read( tek_daemon.wake_fds[0], drained, sizeof drained ) > 0 ) {}
+						tekflash_handle_events( tek_daemon.context );
+						process_daemon_events();
+				}
+
+				// Walk clients backward so that closed ones can be swapped with the last
+				for ( size_t i = tek_daemon.clients_count; i-- > 0; ) {
+						if ( !client_poll_fds[i].revents ) {   continue;   }
+						if ( !read_daemon_client( &tek_daemon.clients[i] ) ) {
+								close( tek_daemon.clients[i].fd );
+								tek_daemon.clients[i] = tek_daemon.clients[--tek_daemon.clients_count];
+						}
+				}
+				for ( size_t i = tek_daemon.metrics_clients_count; i-- > 0; ) {
+						if ( !metrics_poll_fds[i].revents ) {   continue;   }
+						if ( !read_metrics_client( &tek_daemon.metrics_clients[i] ) ) {
+								close( tek_daemon.metrics_clients[i].fd );
+								tek_daemon.metrics_clients[i] = tek_daemon.metrics_clients[--tek_daemon.metrics_clients_count];
+						}
+				}
+
+				if ( poll_fds[1].revents ) {
+						int client_fd = accept( socket_fd, NULL, NULL );
+						if ( client_fd >= 0 && tek_daemon.clients_count < DAEMON_MAX_CLIENTS ) {
+								tek_daemon.clients[tek_daemon.clients_count++] = (daemon_client){ .fd = client_fd };
+						} else if ( client_fd >= 0 ) {
+								close( client_fd );
+						}
+				}
+				if ( poll_fds[2].revents ) {
+						int client_fd = accept( tek_daemon.metrics_fd, NULL, NULL );
+						if ( client_fd >= 0 && tek_daemon.metrics_clients_count < DAEMON_MAX_METRICS_CLIENTS ) {
+								tek_daemon.metrics_clients[tek_daemon.metrics_clients_count++] = (daemon_metrics_client){ .fd = client_fd };
+						} else if ( client_fd >= 0 ) {
+								close( client_fd );
+						}
+				}
+		}
+}
+
+char const * run_tek_daemon( char const * socket_path, char const * opt_firmware_filename
+                           , tekflash_options const * context_options
+                           , tek_flash_job const * job_template, enum stats_format_t stats_format
+                           , size_t metrics_port
+                           ) {
+		char const * opt_error = NULL;
+
+		tek_daemon.job_template = job_template;
+		tek_daemon.stats_format = stats_format;
+
+		char const * call_error = tekflash_create( context_options, &tek_daemon.context );
+		if ( call_error ) {
+				opt_error = call_error;
+				goto function_exit;
+		}
+		if ( !tek_daemon.context->hotplug.enabled ) {
+				opt_error = "Daemon mode needs usb hotplug support";
+				goto unwind_context;
+		}
+		// Without external events the context only has the descriptor signalling job ends
+		struct pollfd job_poll_fd;
+		size_t job_poll_fds_sz = 1;
+		call_error = tekflash_get_pollfds( tek_daemon.context, &job_poll_fd, &job_poll_fds_sz );
+		if ( call_error ) {
+				opt_error = call_error;
+				goto unwind_context;
+		}
+
+		if ( opt_firmware_filename ) {
+				printf( "Loading ihex firmware file.\n" );
+				call_error = load_daemon_image( DAEMON_ANY_BCD_DEVICE, opt_firmware_filename );
+				if ( call_error ) {
+						opt_error = format_error( "Unable to load hex buffer from file: %s", call_error );
+						goto unwind_images;
+				}
+				print_image_summary( tek_daemon.images[0].image );
+		}
+
+		if ( pipe( tek_daemon.wake_fds ) < 0 ) {
+				opt_error = format_error( "Unable to create daemon wake up pipe: %s", strerror( errno ) );
+				goto unwind_images;
+		}
+		fcntl( tek_daemon.wake_fds[0], F_SETFL, O_NONBLOCK );
+		fcntl( tek_daemon.wake_fds[1], F_SETFL, O_NONBLOCK );
+
+		int socket_fd;
+		call_error = open_daemon_socket( socket_path, &socket_fd );
+		if ( call_error ) {
+				opt_error = call_error;
+				goto unwind_wake_pipe;
+		}
+		if ( metrics_port ) {
+				call_error = open_metrics_socket( metrics_port, &tek_daemon.metrics_fd );
+				if ( call_error ) {
+						opt_error = call_error;
+						goto unwind_socket;
+				}
+		}
+
+		struct sigaction stop_action = { .sa_handler = handle_tek_daemon_signal };
+		sigemptyset( &stop_action.sa_mask );
+		sigaction( SIGINT,  &stop_action, NULL );
+		sigaction( SIGTERM, &stop_action, NULL );
+
+		// Keyboards plugged in before the listener was set are in the hotplug table already
+		set_tek_hotplug_listener( tek_daemon.context, queue_tek_daemon_event, NULL );
+		rescan_daemon_devices();
+
+		printf( "Waiting for TEK, control socket at %s\n", socket_path );
+		if ( metrics_port ) {   printf( "Metrics at http://127.0.0.1:%zu/metrics\n", metrics_port );   }
+		fflush( stdout );
+		run_daemon_loop( socket_fd, job_poll_fd.fd );
+
+		printf( "Stopping, waiting for running jobs.\n" );
+		for ( size_t i = 0; i < TEK_MAX_DEVICES; ++i ) {
+				daemon_device * device = &tek_daemon.devices[i];
+				if ( device->state == DAEMON_DEVICE_FLASHING ) {   tekflash_wait( &device->job, NULL );   }
+		}
+		process_daemon_events();
+		print_hub_stats( tek_daemon.context, stats_format );
+
+		set_tek_hotplug_listener( tek_daemon.context, NULL, NULL );
+		for ( size_t i = 0; i < tek_daemon.metrics_clients_count; ++i ) {
+				close( tek_daemon.metrics_clients[i].fd );
+		}
+		tek_daemon.metrics_clients_count = 0;
+		if ( tek_daemon.metrics_fd >= 0 ) {   close( tek_daemon.metrics_fd );   }
+		tek_daemon.metrics_fd = -1;
+	unwind_socket:
+		for ( size_t i = 0; i < tek_daemon.clients_count; ++i ) {
+				close( tek_daemon.clients[i].fd );
+		}
+		tek_daemon.clients_count = 0;
+		close( socket_fd );
+		unlink( socket_path );
+	unwind_wake_pipe:
+		close( tek_daemon.wake_fds[0] );
+		close( tek_daemon.wake_fds[1] );
+	unwind_images:
+		for ( size_t i = 0; i < DAEMON_MAX_IMAGES; ++i ) {
+				free( tek_daemon.images[i].image );
+				tek_daemon.images[i].image = NULL;
+		}
+	unwind_context:
+		tekflash_destroy( tek_daemon.context );
+		tek_daemon.context = NULL;
+	function_exit:
+		return opt_error;
+}
+
+//=== Batch flashing ===//
+
+// Manifest lines are "<selector> <firmware file>", blank lines and lines starting
+// with # are ignored, the first line whose selector matches a TEK wins
+#define BATCH_MAX_ENTRIES  256
+#define BATCH_FILENAME_SZ  256
+#define BATCH_SERIAL_SZ    128
+
+enum batch_selector_t {
+		BATCH_SELECT_PORT,       // port=<bus-port.port...>
+		BATCH_SELECT_SERIAL,     // serial=<serial number string>
+		BATCH_SELECT_BCD_DEVICE  // bcd=<hexadecimal bcdDevice|any>
+};
+
+typedef struct {
+		enum batch_selector_t selector;
+		usb_port_path         port_path;
+		char                  serial[BATCH_SERIAL_SZ];
+		long                  bcd_device;
+		char                  filename[BATCH_FILENAME_SZ];
+		size_t                line_number;
+		size_t                image_index;
+		size_t                devices_count;
+} batch_entry;
+
+// Files named by several lines are parsed once, and files decoding to the same
+// image share it
+static struct {
+		size_t        entries_count;
+		batch_entry   entries[BATCH_MAX_ENTRIES];
+		size_t        images_count;
+		ihex_image *  images[BATCH_MAX_ENTRIES];
+		size_t        jobs_count;
+		tekflash_job  jobs[TEK_MAX_DEVICES];
+		size_t        job_entries[TEK_MAX_DEVICES];
+		tekflash_context * context;
+		// Jobs between their start and the end of their upload
+		pthread_mutex_t mutex;
+		pthread_cond_t  upload_done;
+		size_t          uploading_count;
+} tek_batch = { .mutex = PTHREAD_MUTEX_INITIALIZER, .upload_done = PTHREAD_COND_INITIALIZER };
+
+static char const * parse_batch_entry( char * line, size_t line_number, batch_entry * entry ) {
+		char * selector_end = line;
+		while ( *selector_end && *selector_end != ' ' && *selector_end != '\t' ) {   selector_end += 1;   }
+		char * filename = selector_end;
+		while ( *filename == ' ' || *filename == '\t' ) {   filename += 1;   }
+		*selector_end = '\0';
+
+		*entry = (batch_entry){ .line_number = line_number };
+		if ( !*filename ) {
+				return format_error( "Missing firmware file (line %zu)", line_number );
+		}
+		if ( strlen( filename ) >= sizeof entry->filename ) {
+				return format_error( "Firmware file name too long (line %zu)", line_number );
+		}
+		strcpy( entry->filename, filename );
+
+		if ( strncmp( line, "port=", 5 ) == 0 ) {
+				entry->selector = BATCH_SELECT_PORT;
+				if ( parse_usb_port_path( line+5, &entry->port_path ) ) {   return NULL;   }
+		} else if ( strncmp( line, "serial=", 7 ) == 0 ) {
+				entry->selector = BATCH_SELECT_SERIAL;
+				if ( line[7] && strlen( line+7 ) < sizeof entry->serial ) {
+						strcpy( entry->serial, line+7 );
+						return NULL;
+				}
+		} else if ( strncmp( line, "bcd=", 4 ) == 0 ) {
+				entry->selector = BATCH_SELECT_BCD_DEVICE;
+				if ( parse_bcd_device_argument( line+4, &entry->bcd_device ) ) {   return NULL;   }
+		}
+		return format_error( "Invalid device selector \"%s\" (line %zu)", line, line_number );
+}
+
+static char const * read_batch_manifest( char const * manifest_filename ) {
+		FILE * manifest = fopen( manifest_filename, "r" );
+		if ( !manifest ) {
+				return format_error( "Unable to open batch manifest \"%s\": %s", manifest_filename, strerror( errno ) );
+		}
+
+		char const * opt_error = NULL;
+		char * line = NULL;
+		size_t line_capacity = 0;
+		ssize_t line_sz;
+		size_t line_number = 0;
+		while ( (line_sz = getline( &line, &line_capacity, manifest )) >= 0 ) {
+				line_number += 1;
+				while ( line_sz > 0 && (line[line_sz-1] == '\n' || line[line_sz-1] == '\r'
+				                     || line[line_sz-1] == ' '  || line[line_sz-1] == '\t') ) {
+						line[--line_sz] = '\0';
+				}
+				char * content = line;
+				while ( *content == ' ' || *content == '\t' ) {   content += 1;   }
+				if ( !*content || *content == '#' ) {   continue;   }
+
+				if ( tek_batch.entries_count == BATCH_MAX_ENTRIES ) {
+						opt_error = format_error( "Too many batch entries (line %zu)", line_number );
+						break;
+				}
+				opt_error = parse_batch_entry( content, line_number, &tek_batch.entries[tek_batch.entries_count] );
+				if ( opt_error ) {   break;   }
+				tek_batch.entries_count += 1;
+		}
+		if ( !opt_error && ferror( manifest ) ) {
+				opt_error = format_error( "Unable to read batch manifest \"%s\"", manifest_filename );
+		}
+		if ( !opt_error && !tek_batch.entries_count ) {
+				opt_error = "Batch manifest has no entries";
+		}
+		free( line );
+		fclose( manifest );
+		return opt_error;
+}
+
+static bool same_ihex_images( ihex_image const * lhs, ihex_image const * rhs ) {
+		return lhs->highest_addr == rhs->highest_addr
+		    && memcmp( lhs->page_crcs, rhs->page_crcs, sizeof lhs->page_crcs ) == 0
+		    && memcmp( lhs->coverage,  rhs->coverage,  sizeof lhs->coverage  ) == 0
+		    && memcmp( lhs->bytes,     rhs->bytes,     sizeof lhs->bytes     ) == 0;
+}
+
+static char const * load_batch_images( void ) {
+		for ( size_t i = 0; i < tek_batch.entries_count; ++i ) {
+				batch_entry * entry = &tek_batch.entries[i];
+
+				size_t same_file = 0;
+				while ( same_file < i && strcmp( tek_batch.entries[same_file].filename, entry->filename ) != 0 ) {
+						same_file += 1;
+				}
+				if ( same_file < i ) {
+						entry->image_index = tek_batch.entries[same_file].image_index;
+						continue;
+				}
+
+				ihex_image * image = malloc( sizeof *image );
+				if ( !image ) {   return "Out of memory";   }
+				char const * call_error = tekflash_load_image( tek_batch.context, entry->filename, image );
+				if ( call_error ) {
+						free( image );
+						return format_error( "Unable to load hex buffer from file (line %zu): %s", entry->line_number, call_error );
+				}
+
+				entry->image_index = 0;
+				while ( entry->image_index < tek_batch.images_count
+				     && !same_ihex_images( tek_batch.images[entry->image_index], image )
+				      ) {
+						entry->image_index += 1;
+				}
+				if ( entry->image_index < tek_batch.images_count ) {
+						free( image );
+				} else {
+						tek_batch.images[tek_batch.images_count++] = image;
+				}
+		}
+		return NULL;
+}
+
+static bool batch_entry_matches( batch_entry const * entry, usb_port_path const * port_path
+                               , ui16 bcd_device, char const * serial
+                               ) {
+		switch ( entry->selector ) {
+			case BATCH_SELECT_PORT:       return usb_port_path_equal( &entry->port_path, port_path );
+			case BATCH_SELECT_SERIAL:     return strcmp( entry->serial, serial ) == 0;
+			case BATCH_SELECT_BCD_DEVICE: return entry->bcd_device == DAEMON_ANY_BCD_DEVICE
+			                                  || entry->bcd_device == bcd_device;
+		}
+		return false;
+}
+
+// Jobs are queued round robin over hubs so that workers do not all end up waiting
+// on the slots of one hub while keyboards behind other hubs sit idle
+static void interleave_batch_jobs_by_hub( void ) {
+		size_t hub_ranks[TEK_MAX_DEVICES];
+		for ( size_t i = 0; i < tek_batch.jobs_count; ++i ) {
+				usb_port_path hub_path;
+				get_usb_hub_path( &tek_batch.jobs[i].job.port_path, &hub_path );
+				hub_ranks[i] = 0;
+				for ( size_t j = 0; j < i; ++j ) {
+						usb_port_path other_hub_path;
+						get_usb_hub_path( &tek_batch.jobs[j].job.port_path, &other_hub_path );
+						hub_ranks[i] += usb_port_path_equal( &hub_path, &other_hub_path );
+				}
+		}
+
+		// Stable insertion sort on the rank, keeps manifest order within a round
+		for ( size_t i = 1; i < tek_batch.jobs_count; ++i ) {
+				size_t        rank      = hub_ranks[i];
+				tekflash_job  job       = tek_batch.jobs[i];
+				size_t        job_entry = tek_batch.job_entries[i];
+				size_t j = i;
+				for ( ; j > 0 && hub_ranks[j-1] > rank; --j ) {
+						hub_ranks[j]             = hub_ranks[j-1];
+						tek_batch.jobs[j]        = tek_batch.jobs[j-1];
+						tek_batch.job_entries[j] = tek_batch.job_entries[j-1];
+				}
+				hub_ranks[j]             = rank;
+				tek_batch.jobs[j]        = job;
+				tek_batch.job_entries[j] = job_entry;
+		}
+}
+
+static char const * plan_batch_jobs( tek_flash_job const * job_template ) {
+		usb_port_path tek_port_paths[TEK_MAX_DEVICES];
+		size_t tek_port_paths_sz = TEK_MAX_DEVICES;
+		char const * call_error = find_tek_devices( tek_batch.context, true, tek_port_paths, &tek_port_paths_sz );
+		if ( call_error ) {
+				return format_error( "Unable to connect to a TEK: %s", call_error );
+		}
+
+		bool needs_serial = false;
+		for ( size_t i = 0; i < tek_batch.entries_count; ++i ) {
+				needs_serial |= tek_batch.entries[i].selector == BATCH_SELECT_SERIAL;
+		}
+
+		for ( size_t i = 0; i < tek_port_paths_sz; ++i ) {
+				tek_flash_job * job = &tek_batch.jobs[tek_batch.jobs_count].job;
+				*job = *job_template;
+				job->port_path = tek_port_paths[i];
+				char port_path_string[USB_PORT_PATH_STRING_SZ];
+				snprintf( job->log_prefix, sizeof job->log_prefix, "[%s] "
+				        , format_usb_port_path( &tek_port_paths[i], port_path_string )
+				        );
+
+				ui16 bcd_device;
+				char serial[BATCH_SERIAL_SZ];
+				call_error = get_tek_device_identity( tek_batch.context, &tek_port_paths[i], &bcd_device
+				                                    , needs_serial ? serial : NULL, sizeof serial
+				                                    );
+				if ( call_error ) {
+						fprintf( stderr, "%sError: Unable to identify the TEK: %s\n", job->log_prefix, call_error );
+						continue;
+				}
+
+				size_t entry_index = 0;
+				while ( entry_index < tek_batch.entries_count
+				     && !batch_entry_matches( &tek_batch.entries[entry_index], &tek_port_paths[i], bcd_device, serial )
+				      ) {
+						entry_index += 1;
+				}
+				if ( entry_index == tek_batch.entries_count ) {
+						printf( "%sNo batch entry matches this TEK, left untouched.\n", job->log_prefix );
+						continue;
+				}
+
+				batch_entry * entry = &tek_batch.entries[entry_index];
+				entry->devices_count += 1;
+				job->image = tek_batch.images[entry->image_index];
+				tek_batch.job_entries[tek_batch.jobs_count++] = entry_index;
+		}
+		interleave_batch_jobs_by_hub();
+		return NULL;
+}
+
+static void release_batch_upload( tek_flash_job * job ) {
+		(void)job;
+		pthread_mutex_lock( &tek_batch.mutex );
+		tek_batch.uploading_count -= 1;
+		pthread_cond_signal( &tek_batch.upload_done );
+		pthread_mutex_unlock( &tek_batch.mutex );
+}
+
+// Each job runs on a thread of its own, but at most workers_count of them are switching
+// or uploading: the next one starts as soon as one is done uploading, while the
+// keyboards done before are still verified and reboot
+static void run_batch_jobs( size_t workers_count ) {
+		for ( size_t i = 0; i < tek_batch.jobs_count; ++i ) {
+				tek_flash_job * job = &tek_batch.jobs[i].job;
+				job->opt_upload_done = release_batch_upload;
+				pthread_mutex_lock( &tek_batch.mutex );
+				while ( tek_batch.uploading_count >= workers_count ) {
+						pthread_cond_wait( &tek_batch.upload_done, &tek_batch.mutex );
+				}
+				tek_batch.uploading_count += 1;
+				pthread_mutex_unlock( &tek_batch.mutex );
+
+				// A job that did not start never reaches the end of its upload
+				if ( start_tekflash_job( tek_batch.context, &tek_batch.jobs[i] ) ) {   release_batch_upload( job );   }
+		}
+		for ( size_t i = 0; i < tek_batch.jobs_count; ++i ) {
+				tekflash_wait( &tek_batch.jobs[i], NULL );
+		}
+}
+
+char const * run_tek_batch( char const * manifest_filename, tekflash_options const * context_options
+                          , tek_flash_job const * job_template, size_t workers_count
+                          , enum stats_format_t stats_format
+                          ) {
+		char const * opt_error = read_batch_manifest( manifest_filename );
+		if ( opt_error ) {   goto function_exit;   }
+
+		opt_error = tekflash_create( context_options, &tek_batch.context );
+		if ( opt_error ) {   goto function_exit;   }
+
+		printf( "Loading ihex firmware files.\n" );
+		opt_error = load_batch_images();
+		if ( opt_error ) {   goto unwind_images;   }
+		printf( "Loaded %zu distinct images from %zu manifest entries.\n", tek_batch.images_count, tek_batch.entries_count );
+
+		printf( "Searching for connected TEK\n" );
+		opt_error = plan_batch_jobs( job_template );
+		if ( opt_error ) {   goto unwind_images;   }
+
+		printf( "Flashing %zu TEK, %zu uploading at a time.\n", tek_batch.jobs_count
+		      , workers_count < tek_batch.jobs_count ? workers_count : tek_batch.jobs_count
+		      );
+		run_batch_jobs( workers_count );
+		for ( size_t i = 0; i < tek_batch.jobs_count; ++i ) {
+				print_job_events( &tek_batch.jobs[i].job );
+		}
+
+		printf( "Batch summary:\n" );
+		size_t failed_jobs_count = 0;
+		for ( size_t i = 0; i < tek_batch.jobs_count; ++i ) {
+				tek_flash_job const * job = &tek_batch.jobs[i].job;
+				batch_entry const * entry = &tek_batch.entries[tek_batch.job_entries[i]];
+				if ( job->error ) {
+						printf( "%serror %s (line %zu): %s\n", job->log_prefix, entry->filename, entry->line_number, job->error );
+						failed_jobs_count += 1;
+				} else {
+						printf( "%sok    %s (line %zu)\n", job->log_prefix, entry->filename, entry->line_number );
 				}
+		}
+		size_t unmatched_entries_count = 0;
+		for ( size_t i = 0; i < tek_batch.entries_count; ++i ) {
+				if ( tek_batch.entries[i].devices_count ) {   continue;   }
+				printf( "No TEK matched manifest line %zu\n", tek_batch.entries[i].line_number );
+				unmatched_entries_count += 1;
+		}
+		for ( size_t i = 0; i < tek_batch.jobs_count; ++i ) {
+				print_flash_stats( &tek_batch.jobs[i].job, stats_format );
+		}
+		print_hub_stats( tek_batch.context, stats_format );
 
-				if ( usb_device_descriptor.idVendor == TECK_VENDOR_ID ) {
-						if ( usb_device_descriptor.idProduct == TECK_PRODUCT_ID_NORMAL_STATE
-						  || usb_device_descriptor.idProduct == TECK_PRODUCT_ID_PROGRAMMABLE_STATE
-						   ) {
-								if ( tek_device ) {
-										opt_error = "Multiple TEK keyboards found; make sure to connect only one";
-										goto unwind_usb_devices_list;
+		if ( failed_jobs_count ) {
+				opt_error = format_error( "Flashing failed on %zu out of %zu TEK", failed_jobs_count, tek_batch.jobs_count );
+		} else if ( unmatched_entries_count ) {
+				opt_error = format_error( "%zu manifest entries matched no TEK", unmatched_entries_count );
+		}
+
+	unwind_images:
+		for ( size_t i = 0; i < tek_batch.images_count; ++i ) {
+				free( tek_batch.images[i] );
+		}
+		tek_batch.images_count = 0;
+		tekflash_destroy( tek_batch.context );
+		tek_batch.context = NULL;
+	function_exit:
+		return opt_error;
+}
+
+//=== Image checking ===//
+
+typedef struct {
+		char const * filename;
+		size_t       covered_bytes;
+		size_t       highest_addr;
+		uint32_t     crc;
+		char const * error;
+		char         error_buffer[MAX_ERROR_STRING_SZ];
+} ihex_check;
+
+static struct {
+		enum ihex_load_mode_t load_mode;
+		char const *          opt_cache_dir;
+		size_t                checks_count;
+		ihex_check *          checks;
+		atomic_size_t         next_check;
+} ihex_checks;
+
+// Files are handed out one at a time, so a worker stuck on a large file never
+// holds back the ones queued behind it
+static void * run_ihex_check_worker( void * unused ) {
+		(void)unused;
+		ihex_image * image = malloc( sizeof *image );
+		size_t check_index;
+		while ( (check_index = atomic_fetch_add( &ihex_checks.next_check, 1 )) < ihex_checks.checks_count ) {
+				ihex_check * check = &ihex_checks.checks[check_index];
+				if ( !image ) {
+						check->error = "Out of memory";
+						continue;
+				}
+				char const * call_error = load_ihex_buffer_from_file( check->filename, ihex_checks.load_mode
+				                                                    , ihex_checks.opt_cache_dir, image
+				                                                    );
+				if ( call_error ) {
+						snprintf( check->error_buffer, MAX_ERROR_STRING_SZ, "%s", call_error );
+						check->error = check->error_buffer;
+						continue;
+				}
+				check->covered_bytes = count_image_covered_bytes( image );
+				check->highest_addr  = image->highest_addr;
+				check->crc           = image->crc;
+		}
+		free( image );
+		return NULL;
+}
+
+#define CHECK_MAX_WORKERS 128
+
+char const * run_ihex_checks( char const * const * filenames, size_t filenames_count
+                            , enum ihex_load_mode_t load_mode, char const * opt_cache_dir
+                            , size_t workers_count
+                            ) {
+		char const * opt_error = NULL;
+
+		ihex_checks.checks = calloc( filenames_count, sizeof *ihex_checks.checks );
+		if ( !ihex_checks.checks ) {
+				opt_error = "Out of memory";
+				goto function_exit;
+		}
+		for ( size_t i = 0; i < filenames_count; ++i ) {
+				ihex_checks.checks[i].filename = filenames[i];
+		}
+		ihex_checks.load_mode     = load_mode;
+		ihex_checks.opt_cache_dir = opt_cache_dir;
+		ihex_checks.checks_count  = filenames_count;
+		atomic_store( &ihex_checks.next_check, 0 );
+
+		if ( !workers_count ) {
+				long cores_count = sysconf( _SC_NPROCESSORS_ONLN );
+				workers_count = cores_count > 0 ? (size_t)cores_count : 1;
+		}
+		if ( workers_count > CHECK_MAX_WORKERS ) {   workers_count = CHECK_MAX_WORKERS;   }
+		if ( workers_count > filenames_count )   {   workers_count = filenames_count;     }
+
+		uint64_t start_ns = monotonic_time_ns();
+		// The calling thread is one of the workers
+		pthread_t workers[CHECK_MAX_WORKERS];
+		size_t workers_started = 0;
+		while ( workers_started + 1 < workers_count
+		     && pthread_create( &workers[workers_started], NULL, run_ihex_check_worker, NULL ) == 0
+		      ) {
+				workers_started += 1;
+		}
+		run_ihex_check_worker( NULL );
+		for ( size_t i = 0; i < workers_started; ++i ) {
+				pthread_join( workers[i], NULL );
+		}
+		uint64_t elapsed_ns = monotonic_time_ns() - start_ns;
+
+		size_t failed_checks_count = 0;
+		for ( size_t i = 0; i < filenames_count; ++i ) {
+				ihex_check const * check = &ihex_checks.checks[i];
+				if ( check->error ) {
+						printf( "error %s: %s\n", check->filename, check->error );
+						failed_checks_count += 1;
+				} else {
+						printf( "ok    %s: %zu bytes of data, highest address 0x%04zx, crc32 %08" PRIx32 "\n"
+						      , check->filename, check->covered_bytes, check->highest_addr, check->crc
+						      );
+				}
+		}
+		printf( "Checked %zu files in %.3f ms on %zu threads, %.0f files/s.\n"
+		      , filenames_count, (double)elapsed_ns / 1e6, workers_started + 1
+		      , elapsed_ns ? (double)filenames_count * 1e9 / (double)elapsed_ns : 0.0
+		      );
+		if ( failed_checks_count ) {
+				opt_error = format_error( "%zu out of %zu files failed to load", failed_checks_count, filenames_count );
+		}
+
+		free( ihex_checks.checks );
+		ihex_checks.checks = NULL;
+	function_exit:
+		return opt_error;
+}
+
+//=== Benchmarks ===//
+
+// The simulated bootloader completes a command no sooner than latency (plus up to
+// jitter) after its submission, and no sooner than BENCH_DEVICE_SERVICE_US after the
+// previous command since the control endpoint executes them one at a time
+#define BENCH_DEVICE_SERVICE_US 100
+#define BENCH_MIN_DURATION_NS   200000000u
+
+typedef struct {
+		struct libusb_transfer * transfer;
+		uint64_t                 completion_ns;
+} mock_pending_transfer;
+
+static struct {
+		pthread_mutex_t       mutex;
+		pthread_cond_t        changed;
+		pthread_t             thread;
+		bool                  stop;
+		uint64_t              latency_ns;
+		uint64_t              jitter_ns;
+		uint64_t              last_completion_ns;
+		uint64_t              random_state;
+		size_t                pending_first;
+		size_t                pending_count;
+		mock_pending_transfer pending[UPLOAD_MAX_QUEUE_DEPTH];
+		ui8                   flash[IHEX_BUFFER_MAX_SZ];
+} mock_device = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t next_bench_random( uint64_t * state ) {
+		// xorshift64, plenty for jitter and filler bytes
+		*state ^= *state << 13;
+		*state ^= *state >> 7;
+		*state ^= *state << 17;
+		return *state;
+}
+
+// Called with the mutex held
+static uint64_t schedule_mock_completion( void ) {
+		uint64_t jitter_ns = mock_device.jitter_ns ? next_bench_random( &mock_device.random_state ) % mock_device.jitter_ns : 0;
+		uint64_t completion_ns = monotonic_time_ns() + mock_device.latency_ns + jitter_ns;
+		uint64_t earliest_ns = mock_device.last_completion_ns + BENCH_DEVICE_SERVICE_US * 1000u;
+		if ( completion_ns < earliest_ns ) {   completion_ns = earliest_ns;   }
+		mock_device.last_completion_ns = completion_ns;
+		return completion_ns;
+}
+
+static void ns_to_timespec( uint64_t time_ns, struct timespec * time ) {
+		time->tv_sec  = (time_t)(time_ns / 1000000000u);
+		time->tv_nsec = (long)(time_ns % 1000000000u);
+}
+
+static int run_mock_command( uint8_t request, uint16_t value, ui8 * data, uint16_t length ) {
+		if ( (size_t)value + length > IHEX_BUFFER_MAX_SZ ) {   return LIBUSB_ERROR_PIPE;   }
+		switch ( request ) {
+			case TEK_ISP_REQUEST_WRITE:        memcpy( mock_device.flash + value, data, length );            break;
+			case TEK_ISP_REQUEST_READ:         memcpy( data, mock_device.flash + value, length );            break;
+			case TEK_ISP_REQUEST_ERASE_PAGE:   memset( mock_device.flash + value, 0xFF, TEK_FLASH_PAGE_SZ ); break;
+			case TEK_ISP_REQUEST_SWITCH_STATE:                                                               break; // stays attached
+			default:                           return LIBUSB_ERROR_PIPE; // stalls like an unknown vendor request
+		}
+		return length;
+}
+
+static int submit_mock_transfer( struct libusb_transfer * transfer ) {
+		pthread_mutex_lock( &mock_device.mutex );
+		if ( mock_device.pending_count == UPLOAD_MAX_QUEUE_DEPTH ) {
+				pthread_mutex_unlock( &mock_device.mutex );
+				return LIBUSB_ERROR_BUSY;
+		}
+		size_t last = (mock_device.pending_first + mock_device.pending_count++) % UPLOAD_MAX_QUEUE_DEPTH;
+		mock_device.pending[last] = (mock_pending_transfer){ transfer, schedule_mock_completion() };
+		pthread_cond_signal( &mock_device.changed );
+		pthread_mutex_unlock( &mock_device.mutex );
+		return LIBUSB_SUCCESS;
+}
+
+static int mock_control_transfer( libusb_device_handle * usb_device_handle, uint8_t request_type, uint8_t request
+                                , uint16_t value, uint16_t index, unsigned char * data, uint16_t length
+                                , unsigned int timeout_ms
+                                ) {
+		(void)usb_device_handle; (void)request_type; (void)index; (void)timeout_ms;
+		pthread_mutex_lock( &mock_device.mutex );
+		struct timespec completion;
+		ns_to_timespec( schedule_mock_completion(), &completion );
+		pthread_mutex_unlock( &mock_device.mutex );
+		while ( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &completion, NULL ) == EINTR ) {}
+		return run_mock_command( request, value, data, length );
+}
+
+// Plays the part of the usb event thread, completions come back in submission order
+static void * run_mock_device( void * unused ) {
+		(void)unused;
+		pthread_mutex_lock( &mock_device.mutex );
+		while ( !mock_device.stop ) {
+				if ( !mock_device.pending_count ) {
+						pthread_cond_wait( &mock_device.changed, &mock_device.mutex );
+						continue;
+				}
+				mock_pending_transfer pending = mock_device.pending[mock_device.pending_first];
+				if ( monotonic_time_ns() < pending.completion_ns ) {
+						struct timespec completion;
+						ns_to_timespec( pending.completion_ns, &completion );
+						pthread_cond_timedwait( &mock_device.changed, &mock_device.mutex, &completion );
+						continue;
+				}
+				mock_device.pending_first = (mock_device.pending_first + 1) % UPLOAD_MAX_QUEUE_DEPTH;
+				mock_device.pending_count -= 1;
+				pthread_mutex_unlock( &mock_device.mutex );
+
+				struct libusb_transfer * transfer = pending.transfer;
+				ui8 * setup = transfer->buffer;
+				uint16_t length = (uint16_t)(transfer->length - (int)LIBUSB_CONTROL_SETUP_SIZE);
+				int status = run_mock_command( setup[1], (uint16_t)(setup[2] | setup[3] << 8)
+				                             , setup + LIBUSB_CONTROL_SETUP_SIZE, length
+				                             );
+				transfer->status        = status < 0 ? LIBUSB_TRANSFER_STALL : LIBUSB_TRANSFER_COMPLETED;
+				transfer->actual_length = status < 0 ? 0 : length;
+				transfer->callback( transfer );
+
+				pthread_mutex_lock( &mock_device.mutex );
+		}
+		pthread_mutex_unlock( &mock_device.mutex );
+		return NULL;
+}
+
+static isp_backend const mock_isp_backend = { submit_mock_transfer, mock_control_transfer };
+
+static char const * start_mock_device( size_t latency_us, size_t jitter_us ) {
+		pthread_condattr_t changed_attr;
+		pthread_condattr_init( &changed_attr );
+		pthread_condattr_setclock( &changed_attr, CLOCK_MONOTONIC );
+		pthread_cond_init( &mock_device.changed, &changed_attr );
+		pthread_condattr_destroy( &changed_attr );
+
+		mock_device.stop         = false;
+		mock_device.latency_ns   = latency_us * 1000u;
+		mock_device.jitter_ns    = jitter_us * 1000u;
+		mock_device.random_state = 0x9E3779B97F4A7C15u;
+		memset( mock_device.flash, 0xFF, sizeof mock_device.flash );
+		if ( pthread_create( &mock_device.thread, NULL, run_mock_device, NULL ) != 0 ) {
+				pthread_cond_destroy( &mock_device.changed );
+				return "Unable to start the simulated device thread";
+		}
+		tek_isp_backend = &mock_isp_backend;
+		return NULL;
+}
+
+static void stop_mock_device( void ) {
+		tek_isp_backend = NULL;
+		pthread_mutex_lock( &mock_device.mutex );
+		mock_device.stop = true;
+		pthread_cond_signal( &mock_device.changed );
+		pthread_mutex_unlock( &mock_device.mutex );
+		pthread_join( mock_device.thread, NULL );
+		pthread_cond_destroy( &mock_device.changed );
+}
+
+// Data records of record_sz bytes filling image_sz bytes, with one record out of
+// gap_every left out when gap_every is not 0
+static char * generate_ihex_text( size_t image_sz, size_t record_sz, size_t gap_every
+                                , size_t * text_sz, size_t * records_count
+                                ) {
+		static char const hex_digits[] = "0123456789ABCDEF";
+		size_t text_capacity = (image_sz / record_sz + 2) * (13 + 2 * record_sz);
+		char * text = malloc( text_capacity );
+		if ( !text ) {   return NULL;   }
+
+		uint64_t random_state = 0x2545F4914F6CDD1Du;
+		char * it = text;
+		*records_count = 0;
+		size_t record_index = 0;
+		for ( size_t addr = 0; addr < image_sz; addr += record_sz, ++record_index ) {
+				if ( gap_every && record_index % gap_every == gap_every - 1 ) {   continue;   }
+				size_t size = image_sz - addr < record_sz ? image_sz - addr : record_sz;
+				ui8 record[4 + 255] = { (ui8)size, (ui8)(addr >> 8), (ui8)addr, 0 };
+				for ( size_t i = 0; i < size; ++i ) {
+						record[4+i] = (ui8)next_bench_random( &random_state );
+				}
+				ui8 check_sum = 0;
+				*it++ = ':';
+				for ( size_t i = 0; i < 4 + size; ++i ) {
+						*it++ = hex_digits[record[i] >> 4];
+						*it++ = hex_digits[record[i] & 0x0F];
+						check_sum += record[i];
+				}
+				check_sum = (ui8)-check_sum;
+				*it++ = hex_digits[check_sum >> 4];
+				*it++ = hex_digits[check_sum & 0x0F];
+				*it++ = '\r';
+				*it++ = '\n';
+				*records_count += 1;
+		}
+		memcpy( it, ":00000001FF\r\n", 13 );
+		it += 13;
+		*records_count += 1;
+		*text_sz = (size_t)(it - text);
+		return text;
+}
+
+// The sscanf decoder the nibble table replaced, kept only as the baseline of the
+// loading benchmark: one line at a time into a buffer, every byte through sscanf
+#define SSCANF_IHEX_LINE_MAX_SZ 521
+
+typedef struct {
+		ui8  size;
+		ui16 addr;
+		ui8  type;
+		ui8  data[255];
+		ui8  checksum;
+} sscanf_ihex_record;
+
+static char const * read_record_with_sscanf( char const * line, sscanf_ihex_record * record, ui8 * check_sum ) {
+		size_t length = strlen( line );
+		while ( length > 0 && (line[length-1] == '\n' || line[length-1] == '\r') ) {   length -= 1;   }
+		if ( length < 11 )    {   return "Invalid line length";   }
+		if ( line[0] != ':' ) {   return "Invalid start code";    }
+
+		unsigned size, addr, type;
+		if ( sscanf( line+1, "%2x%4x%2x", &size, &addr, &type ) != 3 ) {   return "Error parsing record header";   }
+		if ( length != 11+2*(size_t)size ) {   return "Invalid line length";   }
+		record->size = (ui8)size;    *check_sum  = (ui8)size;
+		record->addr = (ui16)addr;   *check_sum += (ui8)(addr>>8);
+		                             *check_sum += (ui8)addr;
+		record->type = (ui8)type;    *check_sum += (ui8)type;
+		for ( size_t i = 0; i < (size_t)size; ++i ) {
+				unsigned datum;
+				if ( sscanf( line+9+2*i, "%2x", &datum ) != 1 ) {   return "Error parsing record data";   }
+				record->data[i] = (ui8)datum;   *check_sum += (ui8)datum;
+		}
+		unsigned checksum;
+		if ( sscanf( line+9+2*size, "%2x", &checksum ) != 1 ) {   return "Error parsing record checksum";   }
+		record->checksum = (ui8)checksum;
+		return NULL;
+}
+
+static char const * load_ihex_with_sscanf( char const * text, size_t text_sz, ui8 * bytes, size_t * highest_addr ) {
+		*highest_addr = 0;
+		char const * end = text + text_sz;
+		for ( char const * it = text; it < end; ) {
+				char const * line_end = memchr( it, '\n', (size_t)(end - it) );
+				line_end = line_end ? line_end + 1 : end;
+				size_t line_sz = (size_t)(line_end - it);
+				if ( line_sz > SSCANF_IHEX_LINE_MAX_SZ + 2 ) {   return "Invalid line length";   }
+				char line_buffer[SSCANF_IHEX_LINE_MAX_SZ + 3];
+				memcpy( line_buffer, it, line_sz );
+				line_buffer[line_sz] = '\0';
+				it = line_end;
+
+				sscanf_ihex_record record;
+				ui8 check_sum;
+				char const * call_error = read_record_with_sscanf( line_buffer, &record, &check_sum );
+				if ( call_error ) {   return call_error;   }
+				if ( (ui8)(check_sum + record.checksum) != 0 ) {   return "Invalid record";   }
+				if ( record.type == 1 ) {   break;   }
+				if ( record.type != 0 ) {   return "Only support 8bit ihex format";   }
+				size_t end_addr = record.addr + record.size;
+				if ( end_addr > IHEX_BUFFER_MAX_SZ ) {   return "Addr too high to upload";   }
+				memcpy( bytes + record.addr, record.data, record.size );
+				if ( end_addr > *highest_addr ) {   *highest_addr = end_addr;   }
+		}
+		return NULL;
+}
+
+// Both decoders on a full image, the nibble table one also lays out the CRCs and the
+// transfer frames of the image, which the sscanf one does not
+static char const * benchmark_ihex_decoders( void ) {
+		static size_t const record_sizes[] = { 16, 32, 255 };
+		static ihex_image image;
+		static ui8 reference_bytes[IHEX_BUFFER_MAX_SZ];
+
+		printf( "\nIntel HEX decoders, %zu byte image\n", IHEX_BUFFER_MAX_SZ );
+		printf( "%8s %10s %10s %10s %8s\n", "Record", "Text", "sscanf", "Table", "Speedup" );
+		for ( size_t i = 0; i < sizeof record_sizes / sizeof *record_sizes; ++i ) {
+				size_t text_sz, records_count;
+				char * text = generate_ihex_text( IHEX_BUFFER_MAX_SZ, record_sizes[i], 0, &text_sz, &records_count );
+				if ( !text ) {   return "Out of memory";   }
+
+				double mb_per_s[2];
+				for ( size_t decoder = 0; decoder < 2; ++decoder ) {
+						size_t iterations = 0;
+						uint64_t start_ns = monotonic_time_ns();
+						uint64_t elapsed_ns;
+						do {
+								size_t highest_addr;
+								char const * call_error = decoder ? load_ihex_buffer( text, text_sz, &image )
+								                                  : load_ihex_with_sscanf( text, text_sz, reference_bytes, &highest_addr );
+								if ( call_error ) {
+										free( text );
+										return format_error( "Generated ihex does not load: %s", call_error );
 								}
-								tek_device = *it;
-								*tek_device_state = usb_device_descriptor.idProduct;
+								iterations += 1;
+								elapsed_ns = monotonic_time_ns() - start_ns;
+						} while ( elapsed_ns < BENCH_MIN_DURATION_NS );
+						mb_per_s[decoder] = (double)text_sz * iterations * 1e3 / elapsed_ns;
+				}
+				free( text );
+				if ( memcmp( reference_bytes, image.bytes, IHEX_BUFFER_MAX_SZ ) != 0 ) {
+						return "The decoders do not agree on the generated ihex";
+				}
+
+				printf( "%8zu %10zu %10.1f %10.1f %7.1fx\n", record_sizes[i], text_sz
+				      , mb_per_s[0], mb_per_s[1], mb_per_s[1] / mb_per_s[0]
+				      );
+		}
+		return NULL;
+}
+
+static char const * benchmark_ihex_loading( void ) {
+		static size_t const image_sizes[]  = { 1024, 4096, IHEX_BUFFER_MAX_SZ };
+		static size_t const record_sizes[] = { 16, 32, 255 };
+		static size_t const gaps_every[]   = { 0, 2, 8 };
+		static ihex_image image;
+
+		printf( "%-10s %8s %6s %10s %10s %14s\n", "Image", "Record", "Gaps", "Text", "MB/s", "Records/s" );
+		for ( size_t i = 0; i < sizeof image_sizes / sizeof *image_sizes; ++i ) {
+				for ( size_t j = 0; j < sizeof record_sizes / sizeof *record_sizes; ++j ) {
+						for ( size_t k = 0; k < sizeof gaps_every / sizeof *gaps_every; ++k ) {
+								size_t text_sz, records_count;
+								char * text = generate_ihex_text( image_sizes[i], record_sizes[j], gaps_every[k], &text_sz, &records_count );
+								if ( !text ) {   return "Out of memory";   }
+
+								size_t iterations = 0;
+								uint64_t start_ns = monotonic_time_ns();
+								uint64_t elapsed_ns;
+								do {
+										char const * call_error = load_ihex_buffer( text, text_sz, &image );
+										if ( call_error ) {
+												free( text );
+												return format_error( "Generated ihex does not load: %s", call_error );
+										}
+										iterations += 1;
+										elapsed_ns = monotonic_time_ns() - start_ns;
+								} while ( elapsed_ns < BENCH_MIN_DURATION_NS );
+								free( text );
+
+								char gaps[16];
+								snprintf( gaps, sizeof gaps, gaps_every[k] ? "1/%zu" : "none", gaps_every[k] );
+								printf( "%-10zu %8zu %6s %10zu %10.1f %14.0f\n", image_sizes[i], record_sizes[j], gaps, text_sz
+								      , (double)text_sz * iterations * 1e3 / elapsed_ns
+								      , (double)records_count * iterations * 1e9 / elapsed_ns
+								      );
 						}
 				}
 		}
+		return NULL;
+}
 
-		if ( !tek_device ) {
-				opt_error = "Unable to find a TEK keyboard device connected";
-		} else {
-				status = libusb_open( tek_device, tek_device_handle );
-				if ( status < 0 ) {
-						opt_error = format_error( "Unable to get a handle on the TEK device: %s (%s)"
-						                        , libusb_strerror( status ), libusb_error_name( status )
-						                        );
+static char const * benchmark_upload_run( char const * mode, ihex_image const * image, bool delta, size_t queue_depth ) {
+		libusb_device_handle * mock_handle = (libusb_device_handle *)&mock_device;
+		upload_stats stats;
+		uint64_t start_ns = monotonic_time_ns();
+		char const * call_error = upload_buffer_to_dev( image, mock_handle, delta, queue_depth, NULL, NULL, &stats );
+		uint64_t elapsed_ns = monotonic_time_ns() - start_ns;
+		if ( call_error ) {   return format_error( "Simulated upload failed: %s", call_error );   }
+		if ( memcmp( mock_device.flash, image->bytes, image->highest_addr ) != 0 ) {
+				return "Simulated flash does not match the image after upload";
+		}
+
+		printf( "%-16s %6zu %10.3f %12.0f %10zu %8zu %10.3f\n", mode, queue_depth, elapsed_ns / 1e6
+		      , stats.bytes_sent * 1e9 / elapsed_ns, stats.transfers_count, stats.pages_skipped
+		      , stats.transfers_count ? stats.total_latency_ns / 1e6 / stats.transfers_count : 0.0
+		      );
+		return NULL;
+}
+
+static char const * benchmark_upload( size_t latency_us, size_t jitter_us ) {
+		static ihex_image image;
+		size_t text_sz, records_count;
+		char * text = generate_ihex_text( IHEX_BUFFER_MAX_SZ, 32, 0, &text_sz, &records_count );
+		if ( !text ) {   return "Out of memory";   }
+		char const * opt_error = load_ihex_buffer( text, text_sz, &image );
+		free( text );
+		if ( opt_error ) {   return format_error( "Generated ihex does not load: %s", opt_error );   }
+
+		opt_error = start_mock_device( latency_us, jitter_us );
+		if ( opt_error ) {   return opt_error;   }
+
+		printf( "\nSimulated device: %zu us latency, %zu us jitter, %d us per command\n"
+		      , latency_us, jitter_us, BENCH_DEVICE_SERVICE_US
+		      );
+		printf( "%-16s %6s %10s %12s %10s %8s %10s\n", "Mode", "Depth", "Time (ms)", "Bytes/s", "Transfers", "Skipped", "Avg (ms)" );
+		for ( size_t queue_depth = 1; queue_depth <= UPLOAD_MAX_QUEUE_DEPTH && !opt_error; queue_depth *= 2 ) {
+				memset( mock_device.flash, 0xFF, sizeof mock_device.flash );
+				opt_error = benchmark_upload_run( "full", &image, false, queue_depth );
+		}
+
+		// Delta against a device holding the image with one page changed, then one page in four
+		for ( size_t queue_depth = 1; queue_depth <= UPLOAD_MAX_QUEUE_DEPTH && !opt_error; queue_depth *= 2 ) {
+				mock_device.flash[IHEX_BUFFER_MAX_SZ / 2] ^= 0xFF;
+				opt_error = benchmark_upload_run( "delta 1 page", &image, true, queue_depth );
+		}
+		for ( size_t queue_depth = 1; queue_depth <= UPLOAD_MAX_QUEUE_DEPTH && !opt_error; queue_depth *= 2 ) {
+				for ( size_t page_addr = 0; page_addr < IHEX_BUFFER_MAX_SZ; page_addr += 4 * TEK_FLASH_PAGE_SZ ) {
+						mock_device.flash[page_addr] ^= 0xFF;
 				}
+				opt_error = benchmark_upload_run( "delta 1/4 pages", &image, true, queue_depth );
+		}
+		if ( !opt_error ) {
+				opt_error = benchmark_upload_run( "delta unchanged", &image, true, UPLOAD_DEFAULT_QUEUE_DEPTH );
 		}
 
-	unwind_usb_devices_list:
-		libusb_free_device_list( usb_devices, true );
+		stop_mock_device();
+		return opt_error;
+}
+
+char const * run_benchmarks( size_t latency_us, size_t jitter_us ) {
+		printf( "Intel HEX loading\n" );
+		char const * call_error = benchmark_ihex_loading();
+		if ( call_error ) {   return call_error;   }
+		call_error = benchmark_ihex_decoders();
+		if ( call_error ) {   return call_error;   }
+		return benchmark_upload( latency_us, jitter_us );
+}
+
+//=== Upload captures ===//
+
+// A capture holds the ISP commands of a simulated upload in submission order, after a
+// header describing the run, all in host byte order
+#define UPLOAD_CAPTURE_MAGIC       "TEKCAP01"
+#define UPLOAD_CAPTURE_MAX_ENTRIES 16384
+
+enum upload_capture_flags_t {
+		UPLOAD_CAPTURE_DELTA  = 1 << 0,
+		UPLOAD_CAPTURE_VERIFY = 1 << 1
+};
+
+typedef struct {
+		char     magic[8];
+		uint32_t image_crc;
+		uint32_t highest_addr;
+		uint32_t queue_depth;
+		uint32_t flags;
+		uint32_t latency_us;
+		uint32_t jitter_us;
+		uint64_t duration_ns;
+		uint32_t entries_count;
+		uint32_t padding;
+} upload_capture_header;
+
+typedef struct {
+		uint64_t submit_ns; // since the start of the upload
+		ui16     value;     // flash address
+		ui16     length;
+		ui8      request;
+		ui8      queued;    // submitted without waiting, rather than a blocking control transfer
+		ui8      padding[2];
+} upload_capture_entry;
+
+// Counted past UPLOAD_CAPTURE_MAX_ENTRIES so that an overflow is reported rather than truncated
+static struct {
+		pthread_mutex_t      mutex;
+		uint64_t             start_ns;
+		size_t               entries_count;
+		upload_capture_entry entries[UPLOAD_CAPTURE_MAX_ENTRIES];
+} upload_capture = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+static void capture_isp_command( uint64_t submit_ns, ui8 request, ui16 value, ui16 length, bool queued ) {
+		pthread_mutex_lock( &upload_capture.mutex );
+		if ( upload_capture.entries_count < UPLOAD_CAPTURE_MAX_ENTRIES ) {
+				upload_capture.entries[upload_capture.entries_count] = (upload_capture_entry){
+						.submit_ns = submit_ns - upload_capture.start_ns, .value = value, .length = length
+				, .request = request, .queued = queued
+				};
+		}
+		upload_capture.entries_count += 1;
+		pthread_mutex_unlock( &upload_capture.mutex );
+}
+
+// The setup packet is read before submitting, the transfer may be reused as soon as it completes
+static int submit_captured_transfer( struct libusb_transfer * transfer ) {
+		ui8 const * setup = transfer->buffer;
+		ui8 request  = setup[1];
+		ui16 value   = (ui16)(setup[2] | setup[3] << 8);
+		ui16 length  = (ui16)(setup[6] | setup[7] << 8);
+		uint64_t submit_ns = monotonic_time_ns();
+		int status = mock_isp_backend.submit_transfer( transfer );
+		if ( status == LIBUSB_SUCCESS ) {   capture_isp_command( submit_ns, request, value, length, true );   }
+		return status;
+}
+
+static int captured_control_transfer( libusb_device_handle * usb_device_handle, uint8_t request_type, uint8_t request
+                                    , uint16_t value, uint16_t index, unsigned char * data, uint16_t length
+                                    , unsigned int timeout_ms
+                                    ) {
+		capture_isp_command( monotonic_time_ns(), request, value, length, false );
+		return mock_isp_backend.control_transfer( usb_device_handle, request_type, request, value, index, data, length, timeout_ms );
+}
+
+static isp_backend const capture_isp_backend = { submit_captured_transfer, captured_control_transfer };
+
+static char const * write_upload_capture( char const * capture_filename, upload_capture_header const * header ) {
+		int capture_fd = open( capture_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+		if ( capture_fd < 0 ) {
+				return format_error( "Unable to create capture \"%s\": %s", capture_filename, strerror( errno ) );
+		}
+		char const * call_error = write_whole_file( capture_fd, header, sizeof *header );
+		if ( !call_error ) {
+				call_error = write_whole_file( capture_fd, upload_capture.entries, header->entries_count * sizeof *upload_capture.entries );
+		}
+		if ( close( capture_fd ) < 0 && !call_error ) {   call_error = strerror( errno );   }
+		if ( call_error ) {
+				return format_error( "Unable to write capture \"%s\": %s", capture_filename, call_error );
+		}
+		return NULL;
+}
+
+char const * run_dry_run_upload( char const * firmware_filename, enum ihex_load_mode_t load_mode, char const * opt_cache_dir
+                               , tek_flash_job const * job_template, size_t latency_us, size_t jitter_us
+                               , char const * capture_filename
+                               ) {
+		static ihex_image image;
+		char const * call_error = load_ihex_buffer_from_file( firmware_filename, load_mode, opt_cache_dir, &image );
+		if ( call_error ) {   return call_error;   }
+
+		call_error = start_mock_device( latency_us, jitter_us );
+		if ( call_error ) {   return call_error;   }
+		tek_isp_backend = &capture_isp_backend;
+
+		libusb_device_handle * mock_handle = (libusb_device_handle *)&mock_device;
+		upload_stats stats;
+		upload_capture.entries_count = 0;
+		upload_capture.start_ns = monotonic_time_ns();
+		call_error = upload_buffer_to_dev( &image, mock_handle, job_template->delta, job_template->queue_depth
+		                                 , NULL, NULL, &stats
+		                                 );
+		if ( !call_error && job_template->verify ) {
+				call_error = verify_image_on_dev( &image, mock_handle, NULL, &stats );
+		}
+		uint64_t duration_ns = monotonic_time_ns() - upload_capture.start_ns;
+		stop_mock_device();
+		if ( call_error ) {   return format_error( "Simulated upload failed: %s", call_error );   }
+		if ( upload_capture.entries_count > UPLOAD_CAPTURE_MAX_ENTRIES ) {
+				return format_error( "Simulated upload sent %zu commands, more than the %d a capture holds"
+				                   , upload_capture.entries_count, UPLOAD_CAPTURE_MAX_ENTRIES
+				                   );
+		}
+
+		upload_capture_header header = { .image_crc     = image.crc
+		                               , .highest_addr  = (uint32_t)image.highest_addr
+		                               , .queue_depth   = (uint32_t)job_template->queue_depth
+		                               , .flags         = (job_template->delta  ? UPLOAD_CAPTURE_DELTA  : 0u)
+		                                                | (job_template->verify ? UPLOAD_CAPTURE_VERIFY : 0u)
+		                               , .latency_us    = (uint32_t)latency_us
+		                               , .jitter_us     = (uint32_t)jitter_us
+		                               , .duration_ns   = duration_ns
+		                               , .entries_count = (uint32_t)upload_capture.entries_count
+		                               };
+		memcpy( header.magic, UPLOAD_CAPTURE_MAGIC, sizeof header.magic );
+		call_error = write_upload_capture( capture_filename, &header );
+		if ( call_error ) {   return call_error;   }
+
+		printf( "Dry run: sent %zu bytes in %zu transfers, %zu pages skipped, %.3f ms against the simulated device.\n"
+		      , stats.bytes_sent, stats.transfers_count, stats.pages_skipped, duration_ns / 1e6
+		      );
+		printf( "Capture of %zu commands written to \"%s\".\n", upload_capture.entries_count, capture_filename );
+		return NULL;
+}
+
+typedef struct {
+		upload_capture_header        header;
+		upload_capture_entry const * entries;
+		char *                       contents;
+		// Tallied from the entries and the replay
+		size_t                       erases_count;
+		size_t                       writes_count;
+		size_t                       reads_count;
+		size_t                       bytes_written;
+		size_t                       bytes_read;
+		size_t                       failed_count;
+		uint64_t                     replay_ns;
+} upload_capture_replay;
+
+static char const * read_upload_capture( char const * capture_filename, upload_capture_replay * replay ) {
+		char const * opt_error = NULL;
+
+		int capture_fd = open( capture_filename, O_RDONLY );
+		if ( capture_fd < 0 ) {
+				opt_error = format_error( "Unable to open capture \"%s\": %s", capture_filename, strerror( errno ) );
+				goto function_exit;
+		}
+		struct stat capture_stat;
+		if ( fstat( capture_fd, &capture_stat ) < 0 ) {
+				opt_error = format_error( "Unable to stat capture \"%s\": %s", capture_filename, strerror( errno ) );
+				goto unwind_file;
+		}
+		size_t capture_sz = (size_t)capture_stat.st_size;
+		char const * call_error = read_whole_file( capture_fd, capture_sz, &replay->contents );
+		if ( call_error ) {
+				opt_error = format_error( "Unable to read capture \"%s\": %s", capture_filename, call_error );
+				goto unwind_file;
+		}
+
+		upload_capture_header const * header = (upload_capture_header const *)replay->contents;
+		bool valid = capture_sz >= sizeof *header
+		          && memcmp( header->magic, UPLOAD_CAPTURE_MAGIC, sizeof header->magic ) == 0
+		          && header->entries_count <= UPLOAD_CAPTURE_MAX_ENTRIES
+		          && capture_sz == sizeof *header + header->entries_count * sizeof *replay->entries
+		          && header->queue_depth >= 1 && header->queue_depth <= UPLOAD_MAX_QUEUE_DEPTH;
+		if ( !valid ) {
+				opt_error = format_error( "\"%s\" is not an upload capture", capture_filename );
+				goto unwind_contents;
+		}
+		replay->header  = *header;
+		replay->entries = (upload_capture_entry const *)(header + 1);
+		for ( size_t i = 0; i < header->entries_count; ++i ) {
+				upload_capture_entry const * entry = &replay->entries[i];
+				if ( entry->length > TEK_ISP_CHUNK_SZ || (size_t)entry->value + entry->length > IHEX_BUFFER_MAX_SZ ) {
+						opt_error = format_error( "Invalid command %zu in capture \"%s\"", i, capture_filename );
+						goto unwind_contents;
+				}
+				switch ( entry->request ) {
+					case TEK_ISP_REQUEST_ERASE_PAGE: replay->erases_count += 1;                                       break;
+					case TEK_ISP_REQUEST_WRITE:      replay->writes_count += 1; replay->bytes_written += entry->length; break;
+					default:                         replay->reads_count  += 1; replay->bytes_read    += entry->length; break;
+				}
+		}
+		goto unwind_file;
+
+	unwind_contents:
+		free( replay->contents );
+	unwind_file:
+		close( capture_fd );
 	function_exit:
 		return opt_error;
 }
 
-char const * upload_buffer_to_dev( ui8 * buffer, size_t buffer_sz, libusb_device_handle * usb_device_handle ) {
-		// TODO Actually send the buffer
+typedef struct {
+		struct libusb_transfer * transfer;
+		bool                     in_flight;
+		ui8                      frame[IHEX_WRITE_FRAME_SZ];
+} replay_slot;
+
+static struct {
+		pthread_mutex_t mutex;
+		pthread_cond_t  completed;
+		size_t          failed_count;
+} replay_state = { .mutex = PTHREAD_MUTEX_INITIALIZER, .completed = PTHREAD_COND_INITIALIZER };
+
+static void replay_transfer_completed( struct libusb_transfer * transfer ) {
+		replay_slot * slot = transfer->user_data;
+		pthread_mutex_lock( &replay_state.mutex );
+		if ( transfer->status != LIBUSB_TRANSFER_COMPLETED ) {   replay_state.failed_count += 1;   }
+		slot->in_flight = false;
+		pthread_cond_signal( &replay_state.completed );
+		pthread_mutex_unlock( &replay_state.mutex );
+}
+
+// Every command is sent no sooner than it was in the capture, queued ones through at
+// most the captured queue depth of transfers, so the host side of the schedule is kept
+static char const * replay_upload_capture( upload_capture_replay * replay ) {
+		static replay_slot slots[UPLOAD_MAX_QUEUE_DEPTH];
+		size_t slots_count = replay->header.queue_depth;
+		for ( size_t i = 0; i < slots_count; ++i ) {
+				slots[i].transfer = libusb_alloc_transfer( 0 );
+				if ( !slots[i].transfer ) {
+						while ( i-- > 0 ) {   libusb_free_transfer( slots[i].transfer );   }
+						return "Unable to allocate replay transfers";
+				}
+				slots[i].in_flight = false;
+		}
+
+		libusb_device_handle * mock_handle = (libusb_device_handle *)&mock_device;
+		replay_state.failed_count = 0;
+		size_t next_slot = 0;
+		uint64_t start_ns = monotonic_time_ns();
+		for ( size_t i = 0; i < replay->header.entries_count; ++i ) {
+				upload_capture_entry const * entry = &replay->entries[i];
+				struct timespec submit_time;
+				ns_to_timespec( start_ns + entry->submit_ns, &submit_time );
+				while ( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &submit_time, NULL ) == EINTR ) {}
+
+				uint8_t request_type = entry->request == TEK_ISP_REQUEST_READ ? TEK_ISP_REQUEST_TYPE_IN : TEK_ISP_REQUEST_TYPE_OUT;
+				if ( !entry->queued ) {
+						ui8 data[TEK_ISP_CHUNK_SZ] = { 0 };
+						int status = tek_isp_backend->control_transfer( mock_handle, request_type, entry->request, entry->value, 0
+						                                              , data, entry->length, TEK_ISP_TIMEOUT_MS
+						                                              );
+						if ( status < 0 ) {
+								pthread_mutex_lock( &replay_state.mutex );
+								replay_state.failed_count += 1;
+								pthread_mutex_unlock( &replay_state.mutex );
+						}
+						continue;
+				}
+
+				replay_slot * slot = &slots[next_slot];
+				next_slot = (next_slot + 1) % slots_count;
+				pthread_mutex_lock( &replay_state.mutex );
+				while ( slot->in_flight ) {   pthread_cond_wait( &replay_state.completed, &replay_state.mutex );   }
+				slot->in_flight = true;
+				pthread_mutex_unlock( &replay_state.mutex );
+
+				memset( slot->frame, 0, sizeof slot->frame );
+				libusb_fill_control_setup( slot->frame, request_type, entry->request, entry->value, 0, entry->length );
+				libusb_fill_control_transfer( slot->transfer, mock_handle, slot->frame, replay_transfer_completed, slot
+				                            , TEK_ISP_TIMEOUT_MS
+				                            );
+				if ( tek_isp_backend->submit_transfer( slot->transfer ) != LIBUSB_SUCCESS ) {
+						pthread_mutex_lock( &replay_state.mutex );
+						slot->in_flight = false;
+						replay_state.failed_count += 1;
+						pthread_mutex_unlock( &replay_state.mutex );
+				}
+		}
+		pthread_mutex_lock( &replay_state.mutex );
+		for ( size_t i = 0; i < slots_count; ++i ) {
+				while ( slots[i].in_flight ) {   pthread_cond_wait( &replay_state.completed, &replay_state.mutex );   }
+		}
+		replay->failed_count = replay_state.failed_count;
+		pthread_mutex_unlock( &replay_state.mutex );
+		replay->replay_ns = monotonic_time_ns() - start_ns;
+
+		for ( size_t i = 0; i < slots_count; ++i ) {   libusb_free_transfer( slots[i].transfer );   }
+		return NULL;
+}
+
+// One column per capture, plus the change from the first to the second when there are two
+static void print_capture_row( char const * label, upload_capture_replay const * replays, size_t replays_count
+                             , double (* value)( upload_capture_replay const * replay ), int precision
+                             ) {
+		printf( "%-20s", label );
+		for ( size_t i = 0; i < replays_count; ++i ) {   printf( " %14.*f", precision, value( &replays[i] ) );   }
+		if ( replays_count == 2 ) {   printf( " %+14.*f", precision, value( &replays[1] ) - value( &replays[0] ) );   }
+		printf( "\n" );
+}
+
+static double capture_commands( upload_capture_replay const * replay ) {   return replay->header.entries_count;         }
+static double capture_erases( upload_capture_replay const * replay )   {   return replay->erases_count;                 }
+static double capture_writes( upload_capture_replay const * replay )   {   return replay->writes_count;                 }
+static double capture_written( upload_capture_replay const * replay )  {   return replay->bytes_written;                }
+static double capture_reads( upload_capture_replay const * replay )    {   return replay->reads_count;                  }
+static double capture_read( upload_capture_replay const * replay )     {   return replay->bytes_read;                   }
+static double capture_depth( upload_capture_replay const * replay )    {   return replay->header.queue_depth;           }
+static double capture_time( upload_capture_replay const * replay )     {   return replay->header.duration_ns / 1e6;     }
+static double capture_replay( upload_capture_replay const * replay )   {   return replay->replay_ns / 1e6;              }
+static double capture_failed( upload_capture_replay const * replay )   {   return replay->failed_count;                 }
+
+char const * replay_upload_captures( char const * const * capture_filenames, size_t capture_filenames_count
+                                   , size_t latency_us, size_t jitter_us
+                                   ) {
+		assert( capture_filenames_count >= 1 && capture_filenames_count <= UPLOAD_CAPTURE_MAX_FILES );
+		char const * opt_error = NULL;
+
+		static upload_capture_replay replays[UPLOAD_CAPTURE_MAX_FILES];
+		size_t replays_count = 0;
+		for ( ; replays_count < capture_filenames_count; ++replays_count ) {
+				replays[replays_count] = (upload_capture_replay){ 0 };
+				opt_error = read_upload_capture( capture_filenames[replays_count], &replays[replays_count] );
+				if ( opt_error ) {   goto unwind_replays;   }
+		}
+
+		for ( size_t i = 0; i < replays_count && !opt_error; ++i ) {
+				opt_error = start_mock_device( latency_us, jitter_us );
+				if ( opt_error ) {   goto unwind_replays;   }
+				opt_error = replay_upload_capture( &replays[i] );
+				stop_mock_device();
+		}
+		if ( opt_error ) {   goto unwind_replays;   }
+
+		printf( "Replayed against the simulated device: %zu us latency, %zu us jitter, %d us per command\n"
+		      , latency_us, jitter_us, BENCH_DEVICE_SERVICE_US
+		      );
+		printf( "%-20s", "Capture" );
+		for ( size_t i = 0; i < replays_count; ++i ) {
+				char const * slash = strrchr( capture_filenames[i], '/' );
+				printf( " %14.14s", slash ? slash+1 : capture_filenames[i] );
+		}
+		if ( replays_count == 2 ) {   printf( " %14s", "Change" );   }
+		printf( "\n%-20s", "Image crc" );
+		for ( size_t i = 0; i < replays_count; ++i ) {   printf( "       %08x", (unsigned)replays[i].header.image_crc );   }
+		printf( "\n%-20s", "Mode" );
+		for ( size_t i = 0; i < replays_count; ++i ) {
+				uint32_t flags = replays[i].header.flags;
+				printf( " %14s", flags & UPLOAD_CAPTURE_DELTA ? ( flags & UPLOAD_CAPTURE_VERIFY ? "delta+verify" : "delta" )
+				                                              : ( flags & UPLOAD_CAPTURE_VERIFY ? "full+verify"  : "full"  )
+				      );
+		}
+		printf( "\n" );
+		print_capture_row( "Queue depth",        replays, replays_count, capture_depth,    0 );
+		print_capture_row( "Commands",           replays, replays_count, capture_commands, 0 );
+		print_capture_row( "Pages erased",       replays, replays_count, capture_erases,   0 );
+		print_capture_row( "Writes",             replays, replays_count, capture_writes,   0 );
+		print_capture_row( "Bytes written",      replays, replays_count, capture_written,  0 );
+		print_capture_row( "Reads",              replays, replays_count, capture_reads,    0 );
+		print_capture_row( "Bytes read",         replays, replays_count, capture_read,     0 );
+		print_capture_row( "Captured time (ms)", replays, replays_count, capture_time,     3 );
+		print_capture_row( "Replayed time (ms)", replays, replays_count, capture_replay,   3 );
+		print_capture_row( "Failed commands",    replays, replays_count, capture_failed,   0 );
+
+	unwind_replays:
+		while ( replays_count-- > 0 ) {   free( replays[replays_count].contents );   }
+		return opt_error;
+}
+
+//=== Image diffing ===//
+
+// Bytes of a word that differ, from its xor with the other one
+static size_t count_nonzero_bytes( uint64_t word ) {
+		word |= word >> 4;
+		word |= word >> 2;
+		word |= word >> 1;
+		return (size_t)__builtin_popcountll( word & UINT64_C(0x0101010101010101) );
+}
+
+// Pages are compared as a delta upload does: a page of the new image is programmed
+// unless the old one holds the very same bytes, uncovered ones being erased flash
+static size_t diff_image_page( ihex_image const * old_image, ihex_image const * new_image, size_t page_addr ) {
+		size_t changed_bytes = 0;
+		for ( size_t addr = page_addr; addr < page_addr + TEK_FLASH_PAGE_SZ; addr += sizeof(uint64_t) ) {
+				uint64_t old_word, new_word;
+				memcpy( &old_word, old_image->bytes + addr, sizeof old_word );
+				memcpy( &new_word, new_image->bytes + addr, sizeof new_word );
+				changed_bytes += count_nonzero_bytes( old_word ^ new_word );
+		}
+		return changed_bytes;
+}
+
+// Delta upload of the new image to the simulated device holding the old one
+static char const * simulate_diff_upload( ihex_image const * old_image, ihex_image const * new_image, bool delta
+                                        , size_t queue_depth, uint64_t * upload_ns
+                                        ) {
+		memcpy( mock_device.flash, old_image->bytes, sizeof mock_device.flash );
+		libusb_device_handle * mock_handle = (libusb_device_handle *)&mock_device;
+		upload_stats stats;
+		uint64_t start_ns = monotonic_time_ns();
+		char const * call_error = upload_buffer_to_dev( new_image, mock_handle, delta, queue_depth, NULL, NULL, &stats );
+		*upload_ns = monotonic_time_ns() - start_ns;
+		if ( call_error ) {   return format_error( "Simulated upload failed: %s", call_error );   }
+		return NULL;
+}
+
+char const * diff_ihex_images( char const * old_filename, char const * new_filename
+                             , enum ihex_load_mode_t load_mode, char const * opt_cache_dir
+                             , size_t queue_depth, size_t latency_us, size_t jitter_us
+                             ) {
+		static ihex_image old_image, new_image;
+		char const * call_error = load_ihex_buffer_from_file( old_filename, load_mode, opt_cache_dir, &old_image );
+		if ( call_error ) {   return call_error;   }
+		call_error = load_ihex_buffer_from_file( new_filename, load_mode, opt_cache_dir, &new_image );
+		if ( call_error ) {   return call_error;   }
+
+		size_t highest_addr = old_image.highest_addr > new_image.highest_addr ? old_image.highest_addr : new_image.highest_addr;
+		tek_device_profile const * profile = NULL;
+		for ( size_t i = 0; i < TEK_DEVICE_PROFILES_COUNT && !profile; ++i ) {
+				if ( tek_device_profiles[i].flash_sz >= highest_addr ) {   profile = &tek_device_profiles[i];   }
+		}
+		if ( !profile ) {   return "No supported keyboard has enough flash for these images";   }
+
+		printf( "Old: %s, %zu bytes, crc %08"PRIx32"\n", old_filename, old_image.highest_addr, old_image.crc );
+		printf( "New: %s, %zu bytes, crc %08"PRIx32"\n", new_filename, new_image.highest_addr, new_image.crc );
+
+		size_t changed_pages = 0, changed_bytes = 0, stale_pages = 0;
+		size_t range_start = SIZE_MAX;
+		for ( size_t page_addr = 0; page_addr <= profile->flash_sz; page_addr += TEK_FLASH_PAGE_SZ ) {
+				size_t page_changed_bytes = 0;
+				bool changed = false;
+				if ( page_addr < profile->flash_sz && is_image_page_covered( &new_image, page_addr ) ) {
+						page_changed_bytes = diff_image_page( &old_image, &new_image, page_addr );
+						changed = page_changed_bytes != 0;
+				} else if ( page_addr < profile->flash_sz && is_image_page_covered( &old_image, page_addr ) ) {
+						stale_pages += 1;
+				}
+				if ( changed ) {
+						changed_pages += 1;
+						changed_bytes += page_changed_bytes;
+						if ( range_start == SIZE_MAX ) {   range_start = page_addr;   }
+				} else if ( range_start != SIZE_MAX ) {
+						printf( "Changed 0x%04zx-0x%04zx\n", range_start, page_addr - 1 );
+						range_start = SIZE_MAX;
+				}
+		}
+		printf( "%zu of the %zu pages of a %s change, %zu bytes differ\n"
+		      , changed_pages, profile->flash_sz / profile->page_sz, profile->name, changed_bytes
+		      );
+		if ( stale_pages ) {
+				printf( "%zu pages only hold data of the old image, a delta upload leaves them as they are\n", stale_pages );
+		}
 
+		call_error = start_mock_device( latency_us, jitter_us );
+		if ( call_error ) {   return call_error;   }
+		uint64_t delta_ns, full_ns;
+		call_error = simulate_diff_upload( &old_image, &new_image, true, queue_depth, &delta_ns );
+		if ( !call_error ) {
+				call_error = simulate_diff_upload( &old_image, &new_image, false, queue_depth, &full_ns );
+		}
+		stop_mock_device();
+		if ( call_error ) {   return call_error;   }
+		printf( "Estimated upload: %.3f ms with --delta, %.3f ms without, queue depth %zu against a simulated device"
+		        " answering after %zu us plus %zu us jitter\n"
+		      , delta_ns / 1e6, full_ns / 1e6, queue_depth, latency_us, jitter_us
+		      );
 		return NULL;
 }
@@ -0,0 +1,100 @@
+// Embedding interface of tek-firmware-updater.c, to flash TEK keyboards from a
+// controller process without running the updater for every device
+// Build the updater without its command line with -DTEKFLASH_NO_MAIN and link
+// it with -pthread -lusb-1.0
+//
+// Errors are strings, NULL on success, valid until the next call on the same thread
+#ifndef TEKFLASH_H
+#define TEKFLASH_H
+
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// libusb, the hotplug tracking and the per-hub upload scheduler
+// Each context has a libusb context of its own, any number of them may exist at once
+typedef struct tekflash_context tekflash_context;
+// Decoded firmware image, read-only once loaded and shared by any number of jobs
+typedef struct tekflash_image   tekflash_image;
+// One keyboard going through normal -> programmable -> upload -> normal
+typedef struct tekflash_job     tekflash_job;
+
+typedef struct {
+		char const * opt_cache_dir; // reuse images decoded by previous loads from this directory
+		bool         mmap;          // map firmware files instead of reading them
+		size_t       hub_slots;     // most uploads at once behind one hub, 0 for the default
+		// Without an event thread the caller polls the descriptors of tekflash_get_pollfds
+		// and calls tekflash_handle_events when one is ready or the timeout expired
+		bool         external_events;
+} tekflash_options;
+
+char const * tekflash_create( tekflash_options const * options, tekflash_context * * context );
+// Every job must have been reaped by tekflash_poll or tekflash_wait
+void tekflash_destroy( tekflash_context * context );
+
+// Descriptors to poll: one readable whenever a job ends, plus the usb ones with external events
+// At most *fds_sz entries are filled, *fds_sz is set to how many there are; they may
+// change after any tekflash_handle_events
+char const * tekflash_get_pollfds( tekflash_context * context, struct pollfd * fds, size_t * fds_sz );
+// Longest wait before the next tekflash_handle_events, -1 for none
+int tekflash_get_timeout_ms( tekflash_context * context );
+// Never blocks
+void tekflash_handle_events( tekflash_context * context );
+
+#define TEKFLASH_PORT_PATH_SZ 32 // "bus-port.port.port...", null terminated
+#define TEKFLASH_MAX_DEVICES  127
+
+char const * tekflash_find_devices( tekflash_context * context
+                                  , char port_paths[][TEKFLASH_PORT_PATH_SZ], size_t * port_paths_sz
+                                  );
+
+// Images and jobs live in memory provided by the caller, at least this large and
+// aligned for a uint64_t, as malloc'd memory is
+size_t tekflash_image_size( void );
+size_t tekflash_job_size( void );
+
+char const * tekflash_load_image( tekflash_context * context, char const * filename, tekflash_image * image );
+char const * tekflash_parse_image( char const * ihex_text, size_t ihex_text_sz, tekflash_image * image );
+
+typedef struct {
+		bool     delta;                // only erase and program pages that differ from the device
+		bool     verify;               // read back every programmed page and check its crc
+		size_t   queue_depth;          // usb transfers in flight, 0 for the default
+		unsigned reconnect_timeout_ms; // time allowed to re-enumerate after a switch, 0 for the default
+		// Pages confirmed on the device are recorded in a journal kept in this directory,
+		// a job on the same port with the same image and serial number resumes from the
+		// first one missing, keyboards without a serial number are not journaled
+		char const * opt_journal_dir;
+} tekflash_job_options;
+
+// Starts flashing the TEK at port_path on a thread of its own and returns at once
+// The image and the job memory must be left alone until the job is reaped
+char const * tekflash_submit( tekflash_context * context, char const * port_path
+                            , tekflash_image const * image, tekflash_job_options const * options
+                            , tekflash_job * job
+                            );
+
+enum tekflash_job_state_t {
+		TEKFLASH_JOB_RUNNING,
+		TEKFLASH_JOB_SUCCEEDED,
+		TEKFLASH_JOB_FAILED
+};
+
+typedef struct {
+		size_t       bytes_sent;
+		size_t       transfers_count;
+		size_t       pages_skipped;
+		size_t       pages_resumed;
+		size_t       pages_verified;
+		char const * error; // NULL unless failed, valid as long as the job memory
+} tekflash_job_result;
+
+// Both reap the job once it is over and fill opt_result, only the second blocks
+enum tekflash_job_state_t tekflash_poll( tekflash_job * job, tekflash_job_result * opt_result );
+enum tekflash_job_state_t tekflash_wait( tekflash_job * job, tekflash_job_result * opt_result );
+// The job stops at its next step and fails; a cancelled upload leaves the keyboard
+// in programmable mode, as a failed one does
+void tekflash_cancel( tekflash_job * job );
+
+#endif